@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+#include "buddy_slab.h"
+
+// Benchmark harness. Each workload drives the default pool through
+// alloc_pages/return_pages/query_*. It runs twice: untimed for throughput,
+// then with a timer around every call for latency percentiles.
+//
+//   ./bench [-n ops] [-d] [-r out] [workload...] [-t tracefile] [-T trace]
+//
+// -d runs the workloads that follow in BUDDY_MODE_DEBUG, to measure the
+// cost of the extra validation on every free.
+// Workloads: lifo fifo random buddy small frag (default: all but frag).
+// small churns 32B-2KB objects through alloc_bytes/free_bytes.
+// A text trace has one call per line: "a <slot> <rank>", "f <slot>",
+// "c <rank>" (query_page_counts) or "r <slot>" (query_ranks).
+// -r records the untimed pass of the workloads that follow with
+// trace_pages_start, appending to out, and -T replays such a binary trace
+// against a fresh pool, counting the calls whose result differs.
+
+#define MAXRANK (16)
+#define TESTSIZE (128)
+#define MAXRANK0PAGE (TESTSIZE * 1024 / 4)
+#define PGSIZE (1024 * 4)
+#define SLOTS (4096)
+#define FRAG_SAMPLE (64)
+#define ROUNDS (200000)
+
+enum op_type { OP_ALLOC, OP_FREE, OP_QUERY, OP_TYPES };
+
+static const char *op_names[OP_TYPES] = {"alloc", "free", "query"};
+
+struct bench {
+    void *pool;
+    long ops;  // operations the workload should issue
+    int timed;
+    unsigned int seed;
+    void *slots[SLOTS];
+
+    long issued;
+    long diverged;  // replayed calls whose result differs from the trace
+    long counts[OP_TYPES];
+    float *lat[OP_TYPES];  // per-op latencies in ns, when timed
+    double peak_frag;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned int next_rand(struct bench *b) {
+    b->seed ^= b->seed << 13;
+    b->seed ^= b->seed >> 17;
+    b->seed ^= b->seed << 5;
+    return b->seed;
+}
+
+// 1 - largest free block / all free pages, 0 when nothing is free
+static double fragmentation(void) {
+    int counts[BUDDY_MAX_RANK + 1];
+    long total = 0, largest = 0;
+    int rank;
+    query_page_counts_all(counts);
+    for (rank = 1; rank <= MAXRANK; rank++) {
+        long pages = (long)counts[rank] << (rank - 1);
+        if (pages > 0) largest = 1L << (rank - 1);
+        total += pages;
+    }
+    return total == 0 ? 0 : 1.0 - (double)largest / total;
+}
+
+static void record(struct bench *b, enum op_type type, double start) {
+    if (b->timed) b->lat[type][b->counts[type]] = now_ns() - start;
+    b->counts[type]++;
+    if (++b->issued % FRAG_SAMPLE == 0) {
+        double frag = fragmentation();
+        if (frag > b->peak_frag) b->peak_frag = frag;
+    }
+}
+
+static void *bench_alloc(struct bench *b, int rank) {
+    double start = b->timed ? now_ns() : 0;
+    void *r = alloc_pages(rank);
+    record(b, OP_ALLOC, start);
+    return r;
+}
+
+static int bench_free(struct bench *b, void *p) {
+    double start = b->timed ? now_ns() : 0;
+    int r = return_pages(p);
+    record(b, OP_FREE, start);
+    return r;
+}
+
+static void *bench_alloc_bytes(struct bench *b, size_t size) {
+    double start = b->timed ? now_ns() : 0;
+    void *r = alloc_bytes(size);
+    record(b, OP_ALLOC, start);
+    return r;
+}
+
+static void *bench_alloc_constrained(struct bench *b, int rank,
+                                     int align_rank, void *max_addr) {
+    double start = b->timed ? now_ns() : 0;
+    void *r = alloc_pages_constrained(rank, align_rank, max_addr);
+    record(b, OP_ALLOC, start);
+    return r;
+}
+
+static void bench_free_bytes(struct bench *b, void *p) {
+    double start = b->timed ? now_ns() : 0;
+    free_bytes(p);
+    record(b, OP_FREE, start);
+}
+
+static int bench_query(struct bench *b, void *p, int rank) {
+    double start = b->timed ? now_ns() : 0;
+    int r = p != NULL ? query_ranks(p) : query_page_counts(rank);
+    record(b, OP_QUERY, start);
+    return r;
+}
+
+static int done(struct bench *b) { return b->issued >= b->ops; }
+
+// Allocate a burst, free it newest first
+static void run_lifo(struct bench *b) {
+    while (!done(b)) {
+        int n = 0, i;
+        while (n < SLOTS && !done(b)) {
+            void *r = bench_alloc(b, 1 + next_rand(b) % 3);
+            if (IS_ERR(r)) break;
+            b->slots[n++] = r;
+        }
+        for (i = n - 1; i >= 0; i--) bench_free(b, b->slots[i]);
+    }
+}
+
+// Keep a queue of live blocks, always freeing the oldest
+static void run_fifo(struct bench *b) {
+    int head = 0, live = 0;
+    while (!done(b)) {
+        if (live == SLOTS) {
+            bench_free(b, b->slots[head]);
+            head = (head + 1) % SLOTS;
+            live--;
+        }
+        void *r = bench_alloc(b, 1 + next_rand(b) % 3);
+        if (IS_ERR(r)) continue;
+        b->slots[(head + live) % SLOTS] = r;
+        live++;
+    }
+    while (live-- > 0) {
+        bench_free(b, b->slots[head]);
+        head = (head + 1) % SLOTS;
+    }
+}
+
+// Random slots and ranks, mostly small, with occasional queries
+static void run_random(struct bench *b) {
+    int i;
+    while (!done(b)) {
+        unsigned int r = next_rand(b);
+        i = r % SLOTS;
+        if (r % 16 == 0) {
+            bench_query(b, b->slots[i], 1 + (r >> 8) % MAXRANK);
+        } else if (b->slots[i] != NULL) {
+            bench_free(b, b->slots[i]);
+            b->slots[i] = NULL;
+        } else {
+            // Rank k with probability about 2^-k
+            int rank = 1 + __builtin_ctz((r >> 12) | (1u << 9));
+            void *p = bench_alloc(b, rank);
+            if (!IS_ERR(p)) b->slots[i] = p;
+        }
+    }
+    for (i = 0; i < SLOTS; i++)
+        if (b->slots[i] != NULL) bench_free(b, b->slots[i]);
+}
+
+// Phase 8B of main.c: fill with rank-1 pages, free evens, then odds
+static void run_buddy(struct bench *b) {
+    char *q = b->pool;
+    int pgIdx;
+    while (!done(b)) {
+        for (pgIdx = 0; pgIdx < MAXRANK0PAGE; pgIdx++) bench_alloc(b, 1);
+        for (pgIdx = 0; pgIdx < MAXRANK0PAGE; pgIdx += 2)
+            bench_free(b, q + (size_t)pgIdx * PGSIZE);
+        for (pgIdx = 1; pgIdx < MAXRANK0PAGE; pgIdx += 2)
+            bench_free(b, q + (size_t)pgIdx * PGSIZE);
+    }
+}
+
+// Random slots holding sub-page objects of 32 to 2048 bytes
+static void run_small(struct bench *b) {
+    int i;
+    init_bytes();
+    while (!done(b)) {
+        unsigned int r = next_rand(b);
+        i = r % SLOTS;
+        if (b->slots[i] != NULL) {
+            bench_free_bytes(b, b->slots[i]);
+            b->slots[i] = NULL;
+        } else {
+            void *p = bench_alloc_bytes(b, 32 + (r >> 12) % 2017);
+            if (!IS_ERR(p)) b->slots[i] = p;
+        }
+    }
+    for (i = 0; i < SLOTS; i++)
+        if (b->slots[i] != NULL) bench_free_bytes(b, b->slots[i]);
+}
+
+static const char *trace_path;
+
+// Replay a recorded text trace until it ends or the op budget runs out
+static void run_trace(struct bench *b) {
+    FILE *f = fopen(trace_path, "r");
+    char op;
+    int slot, rank;
+    if (f == NULL) {
+        perror(trace_path);
+        return;
+    }
+    while (!done(b) && fscanf(f, " %c %d", &op, &slot) == 2) {
+        if (slot < 0 || slot >= SLOTS) slot = 0;
+        if (op == 'a' && fscanf(f, "%d", &rank) == 1) {
+            void *p = bench_alloc(b, rank);
+            if (!IS_ERR(p) && b->slots[slot] == NULL) b->slots[slot] = p;
+        } else if (op == 'f' && b->slots[slot] != NULL) {
+            bench_free(b, b->slots[slot]);
+            b->slots[slot] = NULL;
+        } else if (op == 'c') {
+            bench_query(b, NULL, slot);
+        } else if (op == 'r' && b->slots[slot] != NULL) {
+            bench_query(b, b->slots[slot], 0);
+        }
+    }
+    fclose(f);
+    for (slot = 0; slot < SLOTS; slot++)
+        if (b->slots[slot] != NULL) bench_free(b, b->slots[slot]);
+}
+
+static unsigned char *replay_trace;
+static size_t replay_bytes;
+// Block the replay got for each page the recorded run was handed
+static void *replay_blocks[MAXRANK0PAGE];
+
+// Replay a binary trace. Recorded pages are mapped to the blocks this run
+// gets for the same calls, so a different build or policy can replay it.
+static void run_replay(struct bench *b) {
+    struct buddy_trace_reader reader;
+    struct buddy_trace_event ev;
+    char *q = b->pool;
+    int pages = MAXRANK0PAGE, page;
+
+    memset(replay_blocks, 0, sizeof(replay_blocks));
+    if (buddy_trace_open(&reader, replay_trace, replay_bytes) < 0) {
+        fprintf(stderr, "not a trace\n");
+        return;
+    }
+    while (!done(b) && buddy_trace_next(&reader, &ev) == 1) {
+        int known = ev.page >= 0 && ev.page < pages;
+        if (ev.op == BUDDY_TRACE_START) {
+            if (ev.page > MAXRANK0PAGE) {
+                fprintf(stderr, "trace pool of %d pages is too large\n",
+                        ev.page);
+                return;
+            }
+            pages = ev.page;
+            init_page(q, pages);
+            memset(replay_blocks, 0, sizeof(replay_blocks));
+        } else if (ev.op == BUDDY_TRACE_ALLOC) {
+            void *p = bench_alloc(b, ev.rank);
+            if (IS_ERR(p) != (ev.page < 0)) b->diverged++;
+            if (!IS_ERR(p) && known) replay_blocks[ev.page] = p;
+        } else if (ev.op == BUDDY_TRACE_ALLOC_CONSTRAINED) {
+            char *max = ev.limit < pages ? q + (size_t)ev.limit * PGSIZE
+                                         : NULL;
+            void *p = bench_alloc_constrained(b, ev.rank, ev.align_rank, max);
+            if (IS_ERR(p) != (ev.page < 0)) b->diverged++;
+            if (!IS_ERR(p) && known) replay_blocks[ev.page] = p;
+        } else if (ev.op == BUDDY_TRACE_FREE) {
+            void *p = known ? replay_blocks[ev.page] : NULL;
+            if (p == NULL) p = known ? q + (size_t)ev.page * PGSIZE : NULL;
+            else replay_blocks[ev.page] = NULL;
+            if (bench_free(b, p) != ev.result) b->diverged++;
+        } else if (ev.op == BUDDY_TRACE_RANK) {
+            void *p = known ? replay_blocks[ev.page] : NULL;
+            if (p == NULL) p = known ? q + (size_t)ev.page * PGSIZE : NULL;
+            if (bench_query(b, p, 0) != ev.result) b->diverged++;
+        } else if (ev.op == BUDDY_TRACE_COUNT) {
+            if (bench_query(b, NULL, ev.rank) != ev.result) b->diverged++;
+        }
+    }
+    for (page = 0; page < pages; page++)
+        if (replay_blocks[page] != NULL) bench_free(b, replay_blocks[page]);
+}
+
+// Trace output for -r, written a buffer at a time
+static FILE *record_file;
+static unsigned char record_buf[1 << 20];
+
+static void write_trace(const void *buf, size_t bytes, void *arg) {
+    fwrite(buf, 1, bytes, arg);
+}
+
+static int compare_floats(const void *x, const void *y) {
+    float a = *(const float *)x, b = *(const float *)y;
+    return (a > b) - (a < b);
+}
+
+static float percentile(float *lat, long n, double pct) {
+    long i = (long)(pct * (n - 1));
+    return n == 0 ? 0 : lat[i];
+}
+
+static void run_workload(void *pool, const char *name,
+                         void (*run)(struct bench *), long ops) {
+    static struct bench b;
+    double start, elapsed;
+    int type;
+
+    // Untimed pass for throughput
+    memset(&b, 0, sizeof(b));
+    b.pool = pool;
+    b.ops = ops;
+    b.seed = 2463534242u;
+    init_page(pool, MAXRANK0PAGE);
+    if (record_file != NULL)
+        trace_pages_start(record_buf, sizeof(record_buf), write_trace,
+                          record_file);
+    start = now_ns();
+    run(&b);
+    elapsed = now_ns() - start;
+    long issued = b.issued;
+    if (record_file != NULL) trace_pages_stop();
+
+    // Same sequence again with per-op timers
+    memset(&b, 0, sizeof(b));
+    b.pool = pool;
+    b.ops = ops;
+    b.seed = 2463534242u;
+    b.timed = 1;
+    for (type = 0; type < OP_TYPES; type++)
+        b.lat[type] = malloc(sizeof(float) * (issued + 1));
+    init_page(pool, MAXRANK0PAGE);
+    run(&b);
+
+    // One full self-check of the pool left behind, as a watchdog would run
+    start = now_ns();
+    int verified = verify_pages();
+    double verify = now_ns() - start;
+
+    printf("%-8s %10ld ops %8.2f Mops/s  peak frag %.3f\n", name, issued,
+           issued / elapsed * 1e3, b.peak_frag);
+    for (type = 0; type < OP_TYPES; type++) {
+        if (b.counts[type] == 0) continue;
+        qsort(b.lat[type], b.counts[type], sizeof(float), compare_floats);
+        printf("  %-6s %10ld  p50 %7.0f  p99 %7.0f  p999 %7.0f ns\n",
+               op_names[type], b.counts[type],
+               percentile(b.lat[type], b.counts[type], 0.5),
+               percentile(b.lat[type], b.counts[type], 0.99),
+               percentile(b.lat[type], b.counts[type], 0.999));
+    }
+    if (b.diverged > 0) printf("  diverged %ld\n", b.diverged);
+    printf("  verify %.0f ns%s\n", verify, verified == OK ? "" : " FAILED");
+    for (type = 0; type < OP_TYPES; type++) free(b.lat[type]);
+
+    // Counters from the timed pass, when built with BUDDY_STATS
+    struct buddy_stats stats;
+    if (query_stats(&stats) == OK)
+        printf("  splits %lu  merges %lu  failures %lu (%lu fragmented)\n",
+               stats.splits, stats.merges, stats.failures,
+               stats.fragmented_failures);
+}
+
+// Leave the lower half of the pool as isolated rank-1 pages and keep the
+// upper half as one free block, so every larger request searches past a
+// long run of populated low ranks
+static void fragment(void *p) {
+    char *q = p;
+    int pgIdx;
+
+    init_page(p, MAXRANK0PAGE);
+    for (pgIdx = 0; pgIdx < MAXRANK0PAGE / 2; pgIdx++) alloc_pages(1);
+    for (pgIdx = 0; pgIdx < MAXRANK0PAGE / 2; pgIdx += 2)
+        return_pages(q + (size_t)pgIdx * PGSIZE);
+}
+
+// Alloc latency per rank on a mostly fragmented pool
+static void run_frag(void *p) {
+    int rank, round;
+    double start, elapsed;
+
+    fragment(p);
+    printf("fragmented pool: %d free rank-1 blocks, largest rank %d\n",
+           query_page_counts(1), query_ranks((char *)p + TESTSIZE * 512 * 1024));
+
+    printf("%-6s %16s %16s\n", "rank", "alloc+free ns", "miss ns");
+    for (rank = 1; rank <= MAXRANK; rank++) {
+        start = now_ns();
+        for (round = 0; round < ROUNDS; round++) {
+            void *r = alloc_pages(rank);
+            if (!IS_ERR(r)) return_pages(r);
+        }
+        elapsed = now_ns() - start;
+        printf("%-6d %16.1f", rank, elapsed / ROUNDS);
+
+        if (rank == 1) {
+            printf(" %16s\n", "-");
+            continue;
+        }
+
+        // Hold the upper block so the same request can only miss
+        void *big = alloc_pages(MAXRANK - 1);
+        start = now_ns();
+        for (round = 0; round < ROUNDS; round++) alloc_pages(rank);
+        elapsed = now_ns() - start;
+        printf(" %16.1f\n", elapsed / ROUNDS);
+        return_pages(big);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*run)(struct bench *);
+} workloads[] = {
+    {"lifo", run_lifo},
+    {"fifo", run_fifo},
+    {"random", run_random},
+    {"buddy", run_buddy},
+    {"small", run_small},
+};
+
+#define NWORKLOADS ((int)(sizeof(workloads) / sizeof(workloads[0])))
+
+int main(int argc, char **argv) {
+    void *p = malloc(TESTSIZE * sizeof(char) * 1024 * 1024);
+    long ops = 2000000;
+    int selected = 0, i, w;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            ops = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            set_pages_mode(BUDDY_MODE_DEBUG);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            if (record_file != NULL) fclose(record_file);
+            record_file = fopen(argv[++i], "wb");
+            if (record_file == NULL) {
+                perror(argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            FILE *f = fopen(argv[++i], "rb");
+            if (f == NULL) {
+                perror(argv[i]);
+                return 1;
+            }
+            fseek(f, 0, SEEK_END);
+            replay_bytes = ftell(f);
+            rewind(f);
+            replay_trace = malloc(replay_bytes + 1);
+            replay_bytes = fread(replay_trace, 1, replay_bytes, f);
+            fclose(f);
+            run_workload(p, "replay", run_replay, ops);
+            free(replay_trace);
+            selected = 1;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+            run_workload(p, "trace", run_trace, ops);
+            selected = 1;
+        } else if (strcmp(argv[i], "frag") == 0) {
+            run_frag(p);
+            selected = 1;
+        } else {
+            for (w = 0; w < NWORKLOADS; w++)
+                if (strcmp(argv[i], workloads[w].name) == 0) break;
+            if (w == NWORKLOADS) {
+                fprintf(stderr, "unknown workload %s\n", argv[i]);
+                return 1;
+            }
+            run_workload(p, workloads[w].name, workloads[w].run, ops);
+            selected = 1;
+        }
+    }
+    if (!selected)
+        for (w = 0; w < NWORKLOADS; w++)
+            run_workload(p, workloads[w].name, workloads[w].run, ops);
+
+    if (record_file != NULL) fclose(record_file);
+    free(p);
+    return 0;
+}
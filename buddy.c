@@ -1,274 +1,2737 @@
+#define _GNU_SOURCE
 #include "buddy.h"
+#include "buddy_internal.h"
+#include <limits.h>
+#include <sched.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #define NULL ((void *)0)
-#define MAX_RANK 16
-#define PAGE_SIZE (4 * 1024)  // 4KB
+#define MAX_RANK BUDDY_MAX_RANK
+#define PAGE_SIZE BUDDY_PAGE_SIZE  // 4KB unless configured
 
-// Classic buddy system implementation
-static void *memory_base = NULL;
-static int total_pages = 0;
-static int max_rank = 0;
+// Per-page descriptor bits. The metadata array lives outside the managed
+// memory, so allocated blocks carry no header and stay page-aligned.
+#define PAGE_RANK_MASK 0x1f  // Rank of the block, valid on block heads
+#define PAGE_HEAD 0x20       // First page of a block
+#define PAGE_FREE 0x40       // Block is on a free list
+#define PAGE_CACHED 0x80     // Block parked in a cache or in mid-free
 
-// Free lists for each rank
-static void *free_lists[MAX_RANK + 1];
+// Fill byte for blocks freed in debug mode
+#define PAGE_POISON 0x6b
 
-// Structure for free block header
-struct block_header {
+// Marks the end of a free list
+#define NO_PAGE (-1)
+
+// Tag of a block no caller holds, such as one parked in a cache
+#define NO_TAG 0xff
+
+// Pool behind the init_page/alloc_pages/... wrappers. attach_pages and
+// format_pages point it at a pool kept in its own region instead.
+static struct buddy_pool own_pool;
+static struct buddy_pool *default_pool = &own_pool;
+
+// Locking. BUDDY_LOCK_GLOBAL serializes every call on one spinlock per
+// pool. BUDDY_LOCK_RANK gives each free list its own lock instead; ranks
+// are always locked in ascending order, so an allocation holds just the
+// ranks it splits through and a free climbs hand over hand while merging.
+#if BUDDY_LOCKING == BUDDY_LOCK_GLOBAL
+#define pool_lock(pool) spin_lock(&(pool)->lock)
+#define pool_unlock(pool) spin_unlock(&(pool)->lock)
+#else
+#define pool_lock(pool) ((void)(pool))
+#define pool_unlock(pool) ((void)(pool))
+#endif
+
+#if BUDDY_LOCKING == BUDDY_LOCK_RANK
+#define rank_lock(pool, rank) spin_lock(&(pool)->rank_locks[rank])
+#define rank_unlock(pool, rank) spin_unlock(&(pool)->rank_locks[rank])
+// Bits of other ranks change under other locks
+#define mask_set(pool, rank) \
+    __atomic_fetch_or(&(pool)->free_mask, 1u << (rank), __ATOMIC_RELAXED)
+#define mask_clear(pool, rank) \
+    __atomic_fetch_and(&(pool)->free_mask, ~(1u << (rank)), __ATOMIC_RELAXED)
+#else
+#define rank_lock(pool, rank) ((void)(pool), (void)(rank))
+#define rank_unlock(pool, rank) ((void)(pool), (void)(rank))
+#define mask_set(pool, rank) ((pool)->free_mask |= 1u << (rank))
+#define mask_clear(pool, rank) ((pool)->free_mask &= ~(1u << (rank)))
+#endif
+
+// Helper function to release the rank locks in [low, high]
+static inline void unlock_ranks(struct buddy_pool *pool, int low, int high) {
+    for (int rank = low; rank <= high; rank++) rank_unlock(pool, rank);
+}
+
+// Descriptor bytes and the mask are read outside the rank lock that owns
+// them (buddy checks, query_ranks), so they go through relaxed atomics
+static inline unsigned char load_meta(struct buddy_pool *pool, int index) {
+    return __atomic_load_n(&pool->page_meta[index], __ATOMIC_RELAXED);
+}
+
+static inline void store_meta(struct buddy_pool *pool, int index,
+                              unsigned char meta) {
+    __atomic_store_n(&pool->page_meta[index], meta, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int load_mask(struct buddy_pool *pool) {
+    return __atomic_load_n(&pool->free_mask, __ATOMIC_RELAXED);
+}
+
+// Counters bumped from under different locks need atomic increments
+#if BUDDY_LOCKING == BUDDY_LOCK_NONE
+#define shared_add(counter, n) ((counter) += (n))
+#else
+#define shared_add(counter, n) \
+    __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#endif
+
+// Statistics counters compile to nothing unless BUDDY_STATS is set
+#if BUDDY_STATS
+#define stat_add(pool, field, n) shared_add((pool)->stats.field, n)
+#else
+#define stat_add(pool, field, n) ((void)0)
+#endif
+
+// Helper function to total the free pages and, optionally, free blocks
+static long count_free(struct buddy_pool *pool, long *blocks) {
+    long pages = 0, total = 0;
+    for (int r = 1; r <= pool->max_rank; r++) {
+        long count = __atomic_load_n(&pool->free_counts[r], __ATOMIC_RELAXED);
+        pages += count << (r - 1);
+        total += count;
+    }
+    if (blocks != NULL) *blocks = total;
+    return pages;
+}
+
+// Helper function to account an -ENOSPC result for a rank
+static void note_failure(struct buddy_pool *pool, int rank) {
+#if BUDDY_STATS
+    stat_add(pool, failures, 1);
+    if (count_free(pool, NULL) >= 1L << (rank - 1)) {
+        stat_add(pool, fragmented_failures, 1);
+    }
+#else
+    (void)pool;
+    (void)rank;
+#endif
+}
+
+// Helper function to check whether taking pages from the free lists would
+// dip into the reserve kept by the min watermark
+static int below_min(struct buddy_pool *pool, long pages) {
+    long min = __atomic_load_n(&pool->wmark_min, __ATOMIC_RELAXED);
+    return min > 0 &&
+           __atomic_load_n(&pool->free_pages, __ATOMIC_RELAXED) - pages < min;
+}
+
+// Everything below the public entry points works on page frame numbers,
+// page indices from the start of the managed memory. Addresses appear only
+// where a call enters or leaves the allocator.
+
+// Helper function to calculate the number of pages in a block of a rank
+static int rank_pages(int rank) {
+    return 1 << (rank - 1);
+}
+
+// Helper function to get the page frame number of an address. Addresses
+// below the managed memory wrap around to huge numbers, so a single
+// unsigned compare against total_pages bounds-checks the result.
+static size_t addr_to_pfn(struct buddy_pool *pool, void *addr) {
+    return ((uintptr_t)addr - (uintptr_t)pool->memory_base) >>
+           BUDDY_PAGE_SHIFT;
+}
+
+// Helper function to get the address of a page frame number
+static void *pfn_to_addr(struct buddy_pool *pool, int pfn) {
+    return (char *)pool->memory_base + ((size_t)pfn << BUDDY_PAGE_SHIFT);
+}
+
+// Helper function to get the page frame number of a page-aligned address
+// inside the managed memory, or NO_PAGE
+static int head_pfn(struct buddy_pool *pool, void *addr) {
+    size_t pfn = addr_to_pfn(pool, addr);
+    if (pfn >= (size_t)pool->total_pages) return NO_PAGE;
+    if (((uintptr_t)addr - (uintptr_t)pool->memory_base) & (PAGE_SIZE - 1))
+        return NO_PAGE;
+    return pfn;
+}
+
+// Helper function to calculate the buddy of a block
+static int buddy_pfn(int pfn, int rank) {
+    return pfn ^ rank_pages(rank);
+}
+
+#if BUDDY_ADDR_ORDER
+// Helper function to lay out the bitmap tree of every rank for npages
+// pages, storing the offsets in pool unless it is NULL. Returns the words
+// the trees take in total.
+static size_t addr_layout(struct buddy_pool *pool, int npages) {
+    size_t words = 0;
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        size_t bits = ((size_t)npages + rank_pages(rank) - 1) >> (rank - 1);
+        int level = 0;
+        do {
+            bits = (bits + 63) / 64;
+            if (pool != NULL) pool->addr_base[rank][level] = words;
+            words += bits;
+            level++;
+        } while (bits > 1);
+        if (pool != NULL) pool->addr_levels[rank] = level;
+    }
+    return words;
+}
+
+// Helper function to mark the block at index free in the tree of a rank.
+// Levels above only change when a word goes from zero to non-zero.
+static void addr_set(struct buddy_pool *pool, int index, int rank) {
+    size_t bit = index >> (rank - 1);
+    for (int level = 0; level < pool->addr_levels[rank]; level++) {
+        unsigned long long *word =
+            &pool->addr_bits[pool->addr_base[rank][level] + bit / 64];
+        unsigned long long old = *word;
+        *word = old | 1ULL << (bit % 64);
+        if (old != 0) break;
+        bit /= 64;
+    }
+}
+
+static void addr_clear(struct buddy_pool *pool, int index, int rank) {
+    size_t bit = index >> (rank - 1);
+    for (int level = 0; level < pool->addr_levels[rank]; level++) {
+        unsigned long long *word =
+            &pool->addr_bits[pool->addr_base[rank][level] + bit / 64];
+        *word &= ~(1ULL << (bit % 64));
+        if (*word != 0) break;
+        bit /= 64;
+    }
+}
+
+// Helper function to find the lowest free block of a non-empty rank by
+// descending the tree from its single top word
+static int lowest_free(struct buddy_pool *pool, int rank) {
+    size_t bit = 0;
+    for (int level = pool->addr_levels[rank] - 1; level >= 0; level--) {
+        unsigned long long word =
+            pool->addr_bits[pool->addr_base[rank][level] + bit];
+        bit = bit * 64 + __builtin_ctzll(word);
+    }
+    return bit << (rank - 1);
+}
+
+// Helper function to find the lowest free block of a rank whose number,
+// its index over its size, is at least bit. Climbs only until a word with
+// a later bit turns up. Returns the block number, or -1.
+static long addr_next(struct buddy_pool *pool, int rank, size_t bit) {
+    int levels = pool->addr_levels[rank];
+    int level = 0;
+    unsigned long long word;
+    for (;;) {
+        size_t words = level + 1 < levels ? pool->addr_base[rank][level + 1] -
+                                                pool->addr_base[rank][level]
+                                          : 1;
+        if (bit / 64 >= words) return -1;
+        word = pool->addr_bits[pool->addr_base[rank][level] + bit / 64] &
+               ~0ULL << (bit % 64);
+        if (word != 0) break;
+        if (++level == levels) return -1;
+        bit = bit / 64 + 1;
+    }
+
+    bit = bit / 64 * 64 + __builtin_ctzll(word);
+    while (level-- > 0) {
+        unsigned long long below =
+            pool->addr_bits[pool->addr_base[rank][level] + bit];
+        bit = bit * 64 + __builtin_ctzll(below);
+    }
+    return bit;
+}
+#else
+#define addr_set(pool, index, rank) ((void)0)
+#define addr_clear(pool, index, rank) ((void)0)
+#define lowest_free(pool, rank) ((pool)->free_lists[rank])
+#endif
+
+// Trace encoding. Each event is a tag byte holding the kind of event in
+// its low three bits and a rank in the high five, then one varint. Page
+// numbers are stored as zigzag deltas from the previous page number, so
+// runs of nearby pages take a byte each.
+#define TRACE_START 0       // Rank bits: format version; value: pool size
+#define TRACE_ALLOC 1       // Rank asked for; value: page
+#define TRACE_ALLOC_FAIL 2  // Rank asked for; value: 0
+#define TRACE_FREE 3        // Value: page
+#define TRACE_FREE_FAIL 4   // Value: page
+#define TRACE_RANK 5        // Rank answered, 0 for -EINVAL; value: page
+#define TRACE_COUNT 6       // Rank asked for; value: zigzag count
+#define TRACE_CONSTRAINED 7 // Rank asked for; values: align rank << 1 |
+                            // failed, page limit, then page unless failed
+#define TRACE_VERSION 1
+#define TRACE_EVENT_MAX 16  // Tag plus three 32-bit varints
+
+#if BUDDY_LOCKING == BUDDY_LOCK_NONE
+#define trace_lock(trace) ((void)(trace))
+#define trace_unlock(trace) ((void)(trace))
+#else
+#define trace_lock(trace) spin_lock(&(trace)->lock)
+#define trace_unlock(trace) spin_unlock(&(trace)->lock)
+#endif
+
+// Whether calls on a pool are being recorded. Callers check this without
+// the trace lock, and trace_put looks again under it.
+#define tracing(pool) \
+    (__atomic_load_n(&(pool)->trace.buf, __ATOMIC_RELAXED) != NULL)
+
+static unsigned int zigzag(int value) {
+    return ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+}
+
+static int unzigzag(unsigned int value) {
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+// Helper function to take the trace lock and make room for an event.
+// Returns where the event goes, or NULL with the lock dropped if it is
+// not recorded.
+static unsigned char *trace_begin(struct buddy_trace *trace) {
+    trace_lock(trace);
+    // Lost a race with buddy_trace_stop
+    if (trace->buf == NULL) {
+        trace_unlock(trace);
+        return NULL;
+    }
+    if (trace->size - trace->used < TRACE_EVENT_MAX) {
+        if (trace->flush == NULL) {
+            trace->dropped++;
+            trace_unlock(trace);
+            return NULL;
+        }
+        trace->flush(trace->buf, trace->used, trace->arg);
+        trace->used = 0;
+    }
+    return trace->buf + trace->used;
+}
+
+static void trace_end(struct buddy_trace *trace, unsigned char *out) {
+    trace->used = out - trace->buf;
+    trace_unlock(trace);
+}
+
+static unsigned char *put_varint(unsigned char *out, unsigned int bits) {
+    while (bits >= 0x80) {
+        *out++ = bits | 0x80;
+        bits >>= 7;
+    }
+    *out++ = bits;
+    return out;
+}
+
+static unsigned char *put_tag(unsigned char *out, int tag, int rank) {
+    *out++ = tag | (rank >= 1 && rank <= 31 ? rank : 0) << 3;
+    return out;
+}
+
+// Helper function to append an event. A page is turned into a delta here,
+// under the trace lock, so that concurrent events keep the chain intact.
+static void trace_put(struct buddy_pool *pool, int tag, int rank, int page,
+                      int value) {
+    struct buddy_trace *trace = &pool->trace;
+    unsigned char *out = trace_begin(trace);
+    if (out == NULL) return;
+
+    // Deltas restart from page 0 with every pool reset
+    if (tag == TRACE_START) trace->last = 0;
+    unsigned int bits = zigzag(value);
+    if (page != NO_PAGE) {
+        bits = zigzag(page - trace->last);
+        trace->last = page;
+    }
+    out = put_tag(out, tag, rank);
+    trace_end(trace, put_varint(out, bits));
+}
+
+// Helper function to append a constrained allocation with the limit, in
+// pages from the start of the pool, that it was asked for
+static void trace_constrained(struct buddy_pool *pool, int rank,
+                              int align_rank, int limit, int page) {
+    struct buddy_trace *trace = &pool->trace;
+    unsigned char *out = trace_begin(trace);
+    if (out == NULL) return;
+
+    out = put_tag(out, TRACE_CONSTRAINED, rank);
+    out = put_varint(out, (unsigned int)align_rank << 1 | (page == NO_PAGE));
+    out = put_varint(out, limit);
+    if (page != NO_PAGE) {
+        out = put_varint(out, zigzag(page - trace->last));
+        trace->last = page;
+    }
+    trace_end(trace, out);
+}
+
+// Helper function to get the page number a trace records for an address
+static int trace_page(struct buddy_pool *pool, void *addr) {
+    size_t pfn = addr_to_pfn(pool, addr);
+    return pfn < (size_t)pool->total_pages ? (int)pfn : pool->total_pages;
+}
+
+// Helper function to push a block onto the free list of its rank
+static void push_free(struct buddy_pool *pool, int index, int rank) {
+    int head = pool->free_lists[rank];
+    pool->page_links[index].prev = NO_PAGE;
+    pool->page_links[index].next = head;
+    if (head != NO_PAGE) pool->page_links[head].prev = index;
+    pool->free_lists[rank] = index;
+    if (pool->free_counts[rank]++ == 0) mask_set(pool, rank);
+    addr_set(pool, index, rank);
+    store_meta(pool, index, PAGE_HEAD | PAGE_FREE | rank);
+}
+
+// Helper function to unlink a specific block from the free list of a rank.
+// The block keeps its head bit and is marked PAGE_CACHED until its caller
+// settles it, so meanwhile it looks free to no buddy check and allocated
+// to no free.
+static void unlink_free(struct buddy_pool *pool, int index, int rank) {
+    int prev = pool->page_links[index].prev;
+    int next = pool->page_links[index].next;
+    if (prev != NO_PAGE) {
+        pool->page_links[prev].next = next;
+    } else {
+        pool->free_lists[rank] = next;
+    }
+    if (next != NO_PAGE) pool->page_links[next].prev = prev;
+    if (--pool->free_counts[rank] == 0) mask_clear(pool, rank);
+    addr_clear(pool, index, rank);
+    store_meta(pool, index, PAGE_HEAD | PAGE_CACHED | rank);
+}
+
+// Helper function to find the head page of the block containing a page.
+// Interior pages never carry PAGE_HEAD, so the first head met while
+// aligning the index down rank by rank is the enclosing block.
+static int find_block_head(struct buddy_pool *pool, int index) {
+    for (int rank = 1; rank <= pool->max_rank; rank++) {
+        int head = index & ~(rank_pages(rank) - 1);
+        if (load_meta(pool, head) & PAGE_HEAD) return head;
+    }
+    return NO_PAGE;
+}
+
+// Blocks of a bulk call are sorted and coalesced in chunks of this size
+#define BULK_CHUNK 256
+
+struct bulk_entry {
+    int index;
     int rank;
-    struct block_header *next;
 };
 
-// Helper function to calculate the size for a given rank
-static size_t rank_to_size(int rank) {
-    return PAGE_SIZE * (1 << (rank - 1));
+static int alloc_block(struct buddy_pool *pool, int rank);
+static int alloc_bulk(struct buddy_pool *pool, int rank, int n, int *out);
+static void free_block(struct buddy_pool *pool, int index, int rank);
+static int free_entries(struct buddy_pool *pool, struct bulk_entry *batch,
+                        int count);
+
+#if BUDDY_TAGS
+// Helper function to charge the pages of a new block to a tag, refusing
+// to take it over its limit
+static int charge_tag(struct buddy_pool *pool, int tag, long pages) {
+    if (pool->tag_limits[tag] == 0) {
+        shared_add(pool->tag_pages[tag], pages);
+        return 1;
+    }
+    if (__atomic_add_fetch(&pool->tag_pages[tag], pages, __ATOMIC_RELAXED) >
+        pool->tag_limits[tag]) {
+        __atomic_sub_fetch(&pool->tag_pages[tag], pages, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+static void uncharge_tag(struct buddy_pool *pool, int tag, long pages) {
+    shared_add(pool->tag_pages[tag], -pages);
+}
+
+// Helper function to take the tag off a claimed block before it is freed
+static void drop_tag(struct buddy_pool *pool, int index, int rank) {
+    int tag = pool->page_tags[index];
+    pool->page_tags[index] = NO_TAG;
+    if (tag != NO_TAG) uncharge_tag(pool, tag, rank_pages(rank));
+}
+#endif
+
+#if BUDDY_PCP
+// Per-CPU page caches. Each cache keeps a stack of low-rank blocks that
+// the free lists regard as allocated, refilled and drained BUDDY_PCP_BATCH
+// blocks at a time. The cache lock only orders the threads that share a
+// CPU slot and is always taken before any pool lock.
+#if BUDDY_LOCKING == BUDDY_LOCK_NONE
+#define pcp_lock(pcp) ((void)(pcp))
+#define pcp_unlock(pcp) ((void)(pcp))
+#else
+#define pcp_lock(pcp) spin_lock(&(pcp)->lock)
+#define pcp_unlock(pcp) spin_unlock(&(pcp)->lock)
+#endif
+
+// Helper function to pick the cache of the calling CPU
+static struct buddy_pcp *this_pcp(struct buddy_pool *pool) {
+    int cpu = sched_getcpu();
+    if (cpu < 0) cpu = 0;
+    return &pool->pcp[cpu % BUDDY_PCP_SLOTS];
+}
+
+// Helper function to hand cached blocks [0, n) back to the free lists
+static void pcp_drain_some(struct buddy_pool *pool, struct buddy_pcp *pcp,
+                           int rank, int n) {
+    int *blocks = pcp->blocks[rank];
+    struct bulk_entry batch[BUDDY_PCP_HIGH];
+    for (int i = 0; i < n; i++) {
+        batch[i].index = blocks[i];
+        batch[i].rank = rank;
+    }
+    pool_lock(pool);
+    free_entries(pool, batch, n);
+    pool_unlock(pool);
+    pcp->counts[rank] -= n;
+    memmove(blocks, blocks + n, pcp->counts[rank] * sizeof(int));
+}
+
+static int pcp_alloc(struct buddy_pool *pool, int rank) {
+    struct buddy_pcp *pcp = this_pcp(pool);
+    pcp_lock(pcp);
+
+    if (pcp->counts[rank] == 0) {
+        int pages[BUDDY_PCP_BATCH];
+        int n = alloc_bulk(pool, rank, BUDDY_PCP_BATCH, pages);
+        if (n == 0) {
+            pcp_unlock(pcp);
+            return NO_PAGE;
+        }
+        stat_add(pool, pcp_refills, 1);
+        // Stack the batch so it is handed out in address order
+        for (int i = 0; i < n; i++) {
+            store_meta(pool, pages[i], PAGE_HEAD | PAGE_CACHED | rank);
+            pcp->blocks[rank][n - 1 - i] = pages[i];
+        }
+        pcp->counts[rank] = n;
+    } else {
+        stat_add(pool, pcp_hits, 1);
+    }
+
+    int index = pcp->blocks[rank][--pcp->counts[rank]];
+    store_meta(pool, index, PAGE_HEAD | rank);
+    pcp_unlock(pcp);
+    return index;
+}
+
+static void pcp_free(struct buddy_pool *pool, int index, int rank) {
+    struct buddy_pcp *pcp = this_pcp(pool);
+    pcp_lock(pcp);
+
+    // Past the high watermark, return the coldest batch
+    if (pcp->counts[rank] == BUDDY_PCP_HIGH) {
+        pcp_drain_some(pool, pcp, rank, BUDDY_PCP_BATCH);
+        stat_add(pool, pcp_drains, 1);
+    }
+
+    store_meta(pool, index, PAGE_HEAD | PAGE_CACHED | rank);
+    pcp->blocks[rank][pcp->counts[rank]++] = index;
+    pcp_unlock(pcp);
+}
+#endif
+
+#if BUDDY_LOCKFREE
+// Lock-free rank-1 stack. Pages on it keep PAGE_CACHED set, so the free
+// lists treat them as allocated, and link through page_links: next points
+// down the stack and prev holds the depth, so a push learns the depth
+// from the old top in the same CAS that publishes it.
+static unsigned long long lf_pack(int top, unsigned long long head) {
+    return ((head >> 32) + 1) << 32 | (unsigned int)(top + 1);
+}
+
+static int lf_top(unsigned long long head) {
+    return (int)(unsigned int)head - 1;
+}
+
+// Helper function to detach the whole stack and free it, merging. The
+// caller holds the pool lock; returns the number of pages moved.
+static int lf_flush(struct buddy_pool *pool) {
+    unsigned long long head = __atomic_load_n(&pool->lf_head, __ATOMIC_ACQUIRE);
+    do {
+        if (lf_top(head) == NO_PAGE) return 0;
+    } while (!__atomic_compare_exchange_n(&pool->lf_head, &head,
+                                          lf_pack(NO_PAGE, head), 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    // The detached chain is private now; concurrent pops fail on the tag
+    struct bulk_entry batch[BULK_CHUNK];
+    int count = 0, moved = 0;
+    for (int index = lf_top(head); index != NO_PAGE;) {
+        int next = pool->page_links[index].next;
+        batch[count].index = index;
+        batch[count].rank = 1;
+        if (++count == BULK_CHUNK) {
+            moved += free_entries(pool, batch, count);
+            count = 0;
+        }
+        index = next;
+    }
+    return moved + free_entries(pool, batch, count);
+}
+
+static int lf_alloc(struct buddy_pool *pool) {
+    unsigned long long head = __atomic_load_n(&pool->lf_head, __ATOMIC_ACQUIRE);
+    int top;
+    do {
+        top = lf_top(head);
+        if (top == NO_PAGE) return alloc_block(pool, 1);
+        // top may be popped and reused meanwhile; the tag then fails the CAS
+        int below = __atomic_load_n(&pool->page_links[top].next,
+                                    __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&pool->lf_head, &head,
+                                        lf_pack(below, head), 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            break;
+    } while (1);
+
+    store_meta(pool, top, PAGE_HEAD | 1);
+    return top;
+}
+
+// The page was claimed by claim_block, which already set PAGE_CACHED
+static void lf_free(struct buddy_pool *pool, int index) {
+    struct page_link *link = &pool->page_links[index];
+    unsigned long long head = __atomic_load_n(&pool->lf_head, __ATOMIC_RELAXED);
+    int depth;
+    do {
+        int top = lf_top(head);
+        depth = top == NO_PAGE ? 1
+                               : __atomic_load_n(&pool->page_links[top].prev,
+                                                 __ATOMIC_RELAXED) + 1;
+        __atomic_store_n(&link->next, top, __ATOMIC_RELAXED);
+        __atomic_store_n(&link->prev, depth, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool->lf_head, &head,
+                                          lf_pack(index, head), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Amortize the merging over BUDDY_LF_HIGH frees
+    if (depth >= BUDDY_LF_HIGH) {
+        pool_lock(pool);
+        lf_flush(pool);
+        pool_unlock(pool);
+    }
+}
+#else
+#define lf_flush(pool) ((void)(pool), 0)
+#endif
+
+#if BUDDY_PCP
+// Helper function to empty the cache of every CPU into the free lists.
+// Takes each cache lock in turn, so the caller holds no lock. Returns the
+// number of blocks moved.
+static int pcp_drain_all(struct buddy_pool *pool) {
+    int moved = 0;
+    for (int slot = 0; slot < BUDDY_PCP_SLOTS; slot++) {
+        struct buddy_pcp *pcp = &pool->pcp[slot];
+        pcp_lock(pcp);
+        for (int rank = 1; rank <= BUDDY_PCP_MAX_RANK; rank++) {
+            moved += pcp->counts[rank];
+            pcp_drain_some(pool, pcp, rank, pcp->counts[rank]);
+        }
+        pcp_unlock(pcp);
+    }
+    return moved;
+}
+#else
+#define pcp_drain_all(pool) ((void)(pool), 0)
+#endif
+
+// Return every block held in per-CPU caches or on the lock-free stack to
+// the free lists
+void buddy_drain(struct buddy_pool *pool) {
+#if BUDDY_LOCKFREE
+    pool_lock(pool);
+    lf_flush(pool);
+    pool_unlock(pool);
+#endif
+#if BUDDY_PCP
+    pcp_drain_all(pool);
+#elif !BUDDY_LOCKFREE
+    (void)pool;
+#endif
+}
+
+// Helper function to put every page of a pool back on the free lists.
+// memory_base, total_pages, page_meta and page_links must be set.
+static void reset_pool(struct buddy_pool *pool) {
+    memset(pool->page_meta, 0, pool->total_pages);
+
+    // Initialize free lists
+    for (int i = 1; i <= MAX_RANK; i++) {
+        pool->free_lists[i] = NO_PAGE;
+        pool->free_counts[i] = 0;
+    }
+    pool->free_mask = 0;
+    pool->free_pages = pool->total_pages;
+    pool->wmark_fired = 0;
+    pool->lazy_pending = 0;
+    pool->compact_cursor = 0;
+#if BUDDY_ADDR_ORDER
+    memset(pool->addr_bits, 0, pool->addr_words * sizeof(*pool->addr_bits));
+#endif
+#if BUDDY_TAGS
+    memset(pool->page_tags, NO_TAG, pool->total_pages);
+    memset(pool->tag_pages, 0, sizeof(pool->tag_pages));
+#endif
+#if BUDDY_STATS
+    memset(&pool->stats, 0, sizeof(pool->stats));
+#endif
+#if BUDDY_PCP
+    memset(pool->pcp, 0, sizeof(pool->pcp));
+#endif
+#if BUDDY_LOCKFREE
+    pool->lf_head = 0;
+#endif
+
+    if (tracing(pool)) {
+        trace_put(pool, TRACE_START, TRACE_VERSION, NO_PAGE,
+                  pool->total_pages);
+    }
+
+    // Calculate the maximum rank that fits in the available memory
+    int pgcount = pool->total_pages;
+    pool->max_rank = 1;
+    while (pool->max_rank < MAX_RANK &&
+           rank_pages(pool->max_rank + 1) <= pgcount) {
+        pool->max_rank++;
+    }
+
+    // Cover the memory with the largest aligned blocks that fit. Each block
+    // starts at a multiple of its own size, and every block after it is
+    // smaller, so no seeded block ever has a complete buddy to merge with.
+    int pfn = 0;
+    int rank = pool->max_rank;
+    while (pfn < pgcount) {
+        while (pgcount - pfn < rank_pages(rank)) {
+            rank--;
+        }
+        push_free(pool, pfn, rank);
+        pfn += rank_pages(rank);
+    }
+}
+
+// Helper function to set up a pool over pgcount pages at p
+static int init_pool(struct buddy_pool *pool, void *p, int pgcount) {
+    if (p == NULL || pgcount <= 0 || pool->region_magic != 0) {
+        return -EINVAL;
+    }
+
+    // Fresh arrays, swapped in only once all of them are there, so a pool
+    // that cannot grow is left as it was. reset_pool fills them in.
+    unsigned char *meta = malloc(pgcount);
+    struct page_link *links = malloc((size_t)pgcount * sizeof(*links));
+    int missing = meta == NULL || links == NULL;
+#if BUDDY_TAGS
+    unsigned char *tags = malloc(pgcount);
+    missing |= tags == NULL;
+#endif
+#if BUDDY_ADDR_ORDER
+    unsigned long long *bits =
+        malloc(addr_layout(NULL, pgcount) * sizeof(*bits));
+    missing |= bits == NULL;
+#endif
+    if (missing) {
+        free(meta);
+        free(links);
+#if BUDDY_TAGS
+        free(tags);
+#endif
+#if BUDDY_ADDR_ORDER
+        free(bits);
+#endif
+        return -ENOMEM;
+    }
+
+    free(pool->page_meta);
+    pool->page_meta = meta;
+    free(pool->page_links);
+    pool->page_links = links;
+#if BUDDY_TAGS
+    free(pool->page_tags);
+    pool->page_tags = tags;
+#endif
+#if BUDDY_ADDR_ORDER
+    free(pool->addr_bits);
+    pool->addr_bits = bits;
+    pool->addr_words = addr_layout(pool, pgcount);
+#endif
+
+    pool->memory_base = p;
+    pool->total_pages = pgcount;
+    reset_pool(pool);
+
+    return OK;
+}
+
+// Mappings made by buddy_init_mapped. hugetlb mappings come aligned to
+// their page size; others are over-allocated and trimmed to the boundary.
+#define HUGE_2M (2UL << 20)
+#define HUGE_1G (1UL << 30)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+// Helper function to unmap the mapping a pool owns, if any
+static void release_mapping(struct buddy_pool *pool) {
+    if (pool->map_base != NULL) {
+        munmap(pool->map_base, pool->map_bytes);
+    }
+    pool->map_base = NULL;
+    pool->map_bytes = 0;
+}
+
+// Helper function to fault every page of a fresh mapping in up front
+static void prefault(char *p, size_t bytes) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(p, bytes, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    size_t step = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < bytes; offset += step) {
+        ((volatile char *)p)[offset] = 0;
+    }
+}
+
+// Helper function to map bytes, a multiple of align, at an align boundary
+static void *map_aligned(size_t bytes, size_t align, unsigned int flags) {
+    int prot = PROT_READ | PROT_WRITE;
+    if (flags & BUDDY_MAP_HUGETLB) {
+        int huge = MAP_HUGETLB | (align == HUGE_1G ? 30 : 21) << MAP_HUGE_SHIFT;
+        if (flags & BUDDY_MAP_PREFAULT) huge |= MAP_POPULATE;
+        void *p = mmap(NULL, bytes, prot, MAP_PRIVATE | MAP_ANONYMOUS | huge,
+                       -1, 0);
+        if (p != MAP_FAILED) return p;
+        // No huge pages reserved; fall through to transparent huge pages
+    }
+
+    int reserve = flags & BUDDY_MAP_NORESERVE ? MAP_NORESERVE : 0;
+    char *raw = mmap(NULL, bytes + align, prot,
+                     MAP_PRIVATE | MAP_ANONYMOUS | reserve, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *p = (char *)(((uintptr_t)raw + align - 1) & ~(align - 1));
+    if (p > raw) munmap(raw, p - raw);
+    munmap(p + bytes, raw + align - p);
+
+    if (flags & (BUDDY_MAP_HUGETLB | BUDDY_MAP_THP)) {
+        madvise(p, bytes, MADV_HUGEPAGE);
+    }
+    if (flags & BUDDY_MAP_PREFAULT) prefault(p, bytes);
+    return p;
+}
+
+// Initialize the buddy system. Must not race with other calls on the pool.
+// A mapping left by buddy_init_mapped is released unless p lies inside it.
+int buddy_init(struct buddy_pool *pool, void *p, int pgcount) {
+    int ret = init_pool(pool, p, pgcount);
+    if (ret == OK) {
+        size_t offset = (uintptr_t)p - (uintptr_t)pool->map_base;
+        if (offset >= pool->map_bytes ||
+            ((size_t)pgcount << BUDDY_PAGE_SHIFT) > pool->map_bytes - offset) {
+            release_mapping(pool);
+        }
+    }
+    return ret;
+}
+
+// Map pgcount pages as the BUDDY_MAP_* flags ask and initialize the pool
+// over them. Returns the base of the managed memory.
+void *buddy_init_mapped(struct buddy_pool *pool, int pgcount,
+                        unsigned int flags) {
+    if (pgcount <= 0 || pool->region_magic != 0 ||
+        (flags & ~(BUDDY_MAP_HUGETLB | BUDDY_MAP_THP | BUDDY_MAP_PREFAULT |
+                   BUDDY_MAP_ALIGN_1G | BUDDY_MAP_NORESERVE))) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    // Round up to whole huge pages so the tail is never a partial one
+    size_t align = flags & BUDDY_MAP_ALIGN_1G ? HUGE_1G : HUGE_2M;
+    size_t bytes = (((size_t)pgcount << BUDDY_PAGE_SHIFT) + align - 1) &
+                   ~(align - 1);
+    void *p = map_aligned(bytes, align, flags);
+    if (p == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    int ret = init_pool(pool, p, pgcount);
+    if (ret < 0) {
+        munmap(p, bytes);
+        return ERR_PTR(ret);
+    }
+    release_mapping(pool);
+    pool->map_base = p;
+    pool->map_bytes = bytes;
+    return p;
+}
+
+// Region pools. The pool header comes first, then the address-order
+// bitmaps when built with them, the links and the descriptors of the
+// managed pages, rounded up to whole pages; the managed pages follow. Free
+// lists hold page indices rather than pointers, so mapping the region
+// again only needs the base pointers rebased.
+#define REGION_MAGIC 0x4255444459ul  // "BUDDY"
+
+// Helper function to get the signature of this build's region layout, so
+// a region written with other compile-time options is refused
+static unsigned long region_signature(void) {
+    return REGION_MAGIC ^ ((unsigned long)sizeof(struct buddy_pool) << 40) ^
+           ((unsigned long)BUDDY_PAGE_SHIFT << 56);
+}
+
+// Helper function to count the pages taken by the metadata of a region
+// pool managing npages pages
+static int region_overhead(int npages) {
+    size_t bytes = sizeof(struct buddy_pool) +
+                   (size_t)npages * (sizeof(struct page_link) + 1);
+#if BUDDY_TAGS
+    bytes += npages;
+#endif
+#if BUDDY_ADDR_ORDER
+    bytes += addr_layout(NULL, npages) * sizeof(unsigned long long);
+#endif
+    return (bytes + PAGE_SIZE - 1) >> BUDDY_PAGE_SHIFT;
+}
+
+// Helper function to point a region pool at its metadata and pages
+static void region_rebase(struct buddy_pool *pool) {
+    int overhead = pool->region_pages - pool->total_pages;
+#if BUDDY_ADDR_ORDER
+    pool->addr_bits = (unsigned long long *)(pool + 1);
+    pool->page_links = (struct page_link *)(pool->addr_bits + pool->addr_words);
+#else
+    pool->page_links = (struct page_link *)(pool + 1);
+#endif
+    pool->page_meta = (unsigned char *)(pool->page_links + pool->total_pages);
+#if BUDDY_TAGS
+    pool->page_tags = pool->page_meta + pool->total_pages;
+#endif
+    pool->memory_base = (char *)pool + ((size_t)overhead << BUDDY_PAGE_SHIFT);
+}
+
+// Helper function to check that a region can hold a pool header. It must
+// be page-aligned, since the managed pages follow the header pages, and
+// every block handed out would be misaligned otherwise.
+static int region_usable(void *p, int pgcount) {
+    return p != NULL && pgcount > 0 && (uintptr_t)p % PAGE_SIZE == 0 &&
+           (uintptr_t)p % _Alignof(struct buddy_pool) == 0 &&
+           ((size_t)pgcount << BUDDY_PAGE_SHIFT) > sizeof(struct buddy_pool);
+}
+
+// Build a fresh pool inside the pgcount pages at p, typically a file or
+// shared mapping, and return it. Must not race with other calls on it.
+struct buddy_pool *buddy_format(void *p, int pgcount) {
+    if (!region_usable(p, pgcount)) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    // Each managed page costs a page plus its descriptor and link
+    size_t bytes = ((size_t)pgcount << BUDDY_PAGE_SHIFT) -
+                   sizeof(struct buddy_pool);
+    int npages = bytes / (PAGE_SIZE + sizeof(struct page_link) + 1);
+    while (npages > 0 && region_overhead(npages) + npages > pgcount) {
+        npages--;
+    }
+    if (npages == 0) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    struct buddy_pool *pool = p;
+    memset(pool, 0, sizeof(*pool));
+    pool->region_pages = pgcount;
+    pool->total_pages = npages;
+#if BUDDY_ADDR_ORDER
+    pool->addr_words = addr_layout(pool, npages);
+#endif
+    region_rebase(pool);
+    reset_pool(pool);
+
+    // Publish the signature last, so a region whose formatting was cut
+    // short never attaches
+    __atomic_store_n(&pool->region_magic, region_signature(), __ATOMIC_RELEASE);
+    return pool;
+}
+
+// Query the size in pages of a region that buddy_format turns into a pool
+// of exactly pgcount pages, or -EINVAL if there is no such size
+int buddy_region_pages(int pgcount) {
+    if (pgcount <= 0) {
+        return -EINVAL;
+    }
+
+    long pages = (long)region_overhead(pgcount) + pgcount;
+    return pages <= INT_MAX ? (int)pages : -EINVAL;
+}
+
+// Reconnect to a pool that buddy_format left in the pgcount pages at p,
+// with its free lists and allocations as they were. Takes O(1) time.
+// Processes sharing a pool while it is in use must map it at the same
+// address, since the base pointers are stored in the region.
+struct buddy_pool *buddy_attach(void *p, int pgcount) {
+    if (!region_usable(p, pgcount)) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    struct buddy_pool *pool = p;
+    if (__atomic_load_n(&pool->region_magic, __ATOMIC_ACQUIRE) !=
+            region_signature() ||
+        pool->region_pages != pgcount) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    // A trace or callback belongs to whoever set it, not to the region
+    memset(&pool->trace, 0, sizeof(pool->trace));
+    pool->wmark_fn = NULL;
+    region_rebase(pool);
+    return pool;
+}
+
+// Helper function to take a block of a valid rank from the cache that
+// serves it, or from the free lists
+static int take_block(struct buddy_pool *pool, int rank) {
+#if BUDDY_PCP
+    if (rank <= BUDDY_PCP_MAX_RANK) {
+        return pcp_alloc(pool, rank);
+    }
+#elif BUDDY_LOCKFREE
+    if (rank == 1) {
+        return lf_alloc(pool);
+    }
+#endif
+    return alloc_block(pool, rank);
+}
+
+// Helper function to allocate a block of any rank, as buddy_alloc_tagged
+static void *alloc_checked(struct buddy_pool *pool, int rank, int tag) {
+    if (rank < 1 || rank > MAX_RANK) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    if (pool->memory_base == NULL) {
+        return ERR_PTR(-ENOSPC);
+    }
+
+    if (rank > pool->max_rank) {
+        note_failure(pool, rank);
+        return ERR_PTR(-ENOSPC);
+    }
+
+#if BUDDY_TAGS
+    if (!charge_tag(pool, tag, rank_pages(rank))) {
+        return ERR_PTR(-EDQUOT);
+    }
+#else
+    (void)tag;
+#endif
+
+    // Blocks parked in the caches of other CPUs are free all the same, so
+    // a miss drains them and tries once more before failing
+    int pfn = take_block(pool, rank);
+    if (pfn == NO_PAGE && pcp_drain_all(pool) > 0) {
+        pfn = take_block(pool, rank);
+    }
+    if (pfn == NO_PAGE) note_failure(pool, rank);
+
+#if BUDDY_TAGS
+    if (pfn == NO_PAGE) {
+        uncharge_tag(pool, tag, rank_pages(rank));
+    } else {
+        pool->page_tags[pfn] = tag;
+    }
+#endif
+    return pfn == NO_PAGE ? ERR_PTR(-ENOSPC) : pfn_to_addr(pool, pfn);
+}
+
+// Helper function to load the low-memory callback and its argument into
+// the caller's locals, so a concurrent buddy_set_watermarks can neither
+// clear the callback between its test and its call nor pair it with
+// another callback's argument. The argument is stored after the callback
+// is cleared, so if the callback still reads the same once the argument
+// is in hand, the two belong together.
+static buddy_watermark_fn wmark_callback(struct buddy_pool *pool,
+                                         void **arg) {
+    buddy_watermark_fn fn = __atomic_load_n(&pool->wmark_fn, __ATOMIC_ACQUIRE);
+    *arg = NULL;
+    while (fn != NULL) {
+        *arg = __atomic_load_n(&pool->wmark_arg, __ATOMIC_ACQUIRE);
+        buddy_watermark_fn again =
+            __atomic_load_n(&pool->wmark_fn, __ATOMIC_ACQUIRE);
+        if (again == fn) break;
+        fn = again;
+    }
+    return fn;
+}
+
+// Helper function to fire the low-memory callback, if any, when free pages
+// fall below the low watermark, once until they climb back to the high one
+static void check_watermarks(struct buddy_pool *pool) {
+    void *arg;
+    buddy_watermark_fn fn = wmark_callback(pool, &arg);
+    if (fn == NULL) {
+        return;
+    }
+
+    long free_pages = __atomic_load_n(&pool->free_pages, __ATOMIC_RELAXED);
+    if (free_pages < __atomic_load_n(&pool->wmark_low, __ATOMIC_RELAXED)) {
+        if (!__atomic_exchange_n(&pool->wmark_fired, 1, __ATOMIC_RELAXED)) {
+            fn(pool, free_pages, arg);
+        }
+    } else if (free_pages >= __atomic_load_n(&pool->wmark_high,
+                                             __ATOMIC_RELAXED) &&
+               __atomic_load_n(&pool->wmark_fired, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&pool->wmark_fired, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Allocate pages of specified rank, charged to a tag below BUDDY_TAGS.
+// A tag at its limit gets -EDQUOT. With a low-memory callback set, a
+// request that fails for want of pages calls it and is tried once more.
+void *buddy_alloc_tagged(struct buddy_pool *pool, int rank, int tag) {
+    if (tag < 0 || tag >= (BUDDY_TAGS > 0 ? BUDDY_TAGS : 1)) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    void *p = alloc_checked(pool, rank, tag), *arg;
+    buddy_watermark_fn fn = wmark_callback(pool, &arg);
+    if (fn != NULL && IS_ERR(p) && PTR_ERR(p) == -ENOSPC) {
+        fn(pool, buddy_free_pages(pool), arg);
+        p = alloc_checked(pool, rank, tag);
+    }
+    check_watermarks(pool);
+    if (tracing(pool)) {
+        if (IS_ERR(p)) {
+            trace_put(pool, TRACE_ALLOC_FAIL, rank, NO_PAGE, 0);
+        } else {
+            trace_put(pool, TRACE_ALLOC, rank, trace_page(pool, p), 0);
+        }
+    }
+    return p;
+}
+
+// Allocate pages of specified rank
+void *buddy_alloc(struct buddy_pool *pool, int rank) {
+    return buddy_alloc_tagged(pool, rank, 0);
+}
+
+// Allocate the smallest block that holds size bytes. With n the page
+// count minus one, the rank is the bit length of 2n + 1, which is 1 for a
+// single page and needs no branch for it.
+void *buddy_alloc_bytes(struct buddy_pool *pool, size_t size) {
+    if (size == 0) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    size_t odd = ((size - 1) >> BUDDY_PAGE_SHIFT) << 1 | 1;
+    int rank = 8 * sizeof(long) - __builtin_clzl(odd);
+    return buddy_alloc(pool, rank);
+}
+
+// Helper function to find the smallest non-empty rank at or above from.
+// Under BUDDY_LOCK_RANK it returns with ranks [low, *top] locked, since a
+// split pushes onto each of them; on failure it returns 0 holding none.
+static int find_source(struct buddy_pool *pool, int low, int from, int *top) {
+    unsigned int candidates = load_mask(pool) & ~((1u << from) - 1);
+    if (candidates == 0) {
+        return 0;
+    }
+    int source = __builtin_ctz(candidates);
+    *top = source;
+
+#if BUDDY_LOCKING == BUDDY_LOCK_RANK
+    // The mask was read unlocked. Lock every rank the split will touch and
+    // look again, climbing further if the block was taken in the meantime.
+    for (int r = low; r <= *top; r++) rank_lock(pool, r);
+    source = from;
+    while (pool->free_lists[source] == NO_PAGE) {
+        if (source == *top) {
+            if (*top == pool->max_rank) {
+                unlock_ranks(pool, low, *top);
+                return 0;
+            }
+            rank_lock(pool, ++*top);
+        }
+        source++;
+    }
+#else
+    (void)low;
+#endif
+
+    stat_add(pool, search_steps, source - from);
+    return source;
+}
+
+// Helper function to hand the memory of a block back to the kernel. The
+// range is trimmed to whole system pages, and the next touch of a private
+// anonymous mapping faults in zeroed pages again. Runs before the block
+// reaches a free list, so no new owner can be writing to it yet.
+static void release_block(struct buddy_pool *pool, int index, int rank) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)pfn_to_addr(pool, index);
+    uintptr_t end = start + ((size_t)rank_pages(rank) << BUDDY_PAGE_SHIFT);
+    start = (start + page - 1) & ~(page - 1);
+    end &= ~(page - 1);
+    if (start < end &&
+        madvise((void *)start, end - start, MADV_DONTNEED) == 0) {
+        stat_add(pool, released, (end - start) >> BUDDY_PAGE_SHIFT);
+    }
+}
+
+// Lazy mode. Frees park blocks on their rank list without merging and
+// count them as pending. This pass merges every free buddy pair, one rank
+// at a time from the bottom, and runs on an allocation miss, on
+// buddy_coalesce, or before a strict query. The caller holds the pool
+// lock; returns the number of merges.
+static int coalesce_pending(struct buddy_pool *pool) {
+    if (__atomic_load_n(&pool->lazy_pending, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+
+    for (int rank = 1; rank <= pool->max_rank; rank++) rank_lock(pool, rank);
+    pool->lazy_pending = 0;
+
+    int merged = 0;
+    for (int rank = 1; rank < pool->max_rank; rank++) {
+        int index = pool->free_lists[rank];
+        while (index != NO_PAGE) {
+            int next = pool->page_links[index].next;
+            int buddy = buddy_pfn(index, rank);
+            if ((unsigned int)buddy < (unsigned int)pool->total_pages &&
+                load_meta(pool, buddy) == (PAGE_HEAD | PAGE_FREE | rank)) {
+                if (next == buddy) next = pool->page_links[buddy].next;
+                unlink_free(pool, index, rank);
+                unlink_free(pool, buddy, rank);
+                int low = index < buddy ? index : buddy;
+                store_meta(pool, index ^ buddy ^ low, 0);
+                if (rank + 1 == pool->release_rank) {
+                    release_block(pool, low, rank + 1);
+                }
+                push_free(pool, low, rank + 1);
+                merged++;
+            }
+            index = next;
+        }
+    }
+    stat_add(pool, merges, merged);
+
+    unlock_ranks(pool, 1, pool->max_rank);
+    return merged;
+}
+
+// Helper function to split the free block at index of rank source, already
+// unlinked, down to the block of rank at target. Only the halves off the
+// path to target go back on the lists.
+static void split_block(struct buddy_pool *pool, int index, int source,
+                        int target, int rank) {
+    while (source > rank) {
+        source--;
+        int half = rank_pages(source);
+        if (target >= index + half) {
+            push_free(pool, index, source);
+            index += half;
+        } else {
+            push_free(pool, index + half, source);
+        }
+    }
+}
+
+// Helper function to take a block of a valid rank from the free lists
+static int alloc_block(struct buddy_pool *pool, int rank) {
+    int top;
+    pool_lock(pool);
+
+    // Pages parked on the lock-free stack count towards the reserve too
+    if (below_min(pool, rank_pages(rank)) &&
+        (lf_flush(pool) == 0 || below_min(pool, rank_pages(rank)))) {
+        pool_unlock(pool);
+        return NO_PAGE;
+    }
+
+    // Find the smallest non-empty rank at or above the requested one
+    int current_rank = find_source(pool, rank, rank, &top);
+    if (current_rank == 0 && lf_flush(pool) + coalesce_pending(pool) > 0) {
+        current_rank = find_source(pool, rank, rank, &top);
+    }
+    if (current_rank == 0) {
+        pool_unlock(pool);
+        return NO_PAGE;
+    }
+    stat_add(pool, allocs[rank], 1);
+    stat_add(pool, splits, current_rank - rank);
+
+    // Remove block from current rank
+    int index = lowest_free(pool, current_rank);
+    unlink_free(pool, index, current_rank);
+
+    // Split blocks until we get the desired rank, keeping the lower half
+    split_block(pool, index, current_rank, index, rank);
+
+    // The head descriptor alone records the allocation
+    store_meta(pool, index, PAGE_HEAD | rank);
+    shared_add(pool->free_pages, -rank_pages(rank));
+
+    unlock_ranks(pool, rank, top);
+    pool_unlock(pool);
+    return index;
+}
+
+// Helper function to allocate up to n blocks of a valid rank into out.
+// Each round carves consecutive blocks off the front of one source block
+// and pushes back its unused tail, instead of splitting once per block.
+static int alloc_bulk(struct buddy_pool *pool, int rank, int n, int *out) {
+    int done = 0, top;
+    pool_lock(pool);
+
+    while (done < n) {
+        // Prefer the smallest block that covers the rest of the request,
+        // otherwise the largest block there is
+        int remaining = n - done;
+        long min = __atomic_load_n(&pool->wmark_min, __ATOMIC_RELAXED);
+        if (min > 0) {
+            long spare = (__atomic_load_n(&pool->free_pages, __ATOMIC_RELAXED) -
+                          min) / rank_pages(rank);
+            if (spare <= 0) break;
+            if (spare < remaining) remaining = spare;
+        }
+        int want = rank;
+        if (remaining > 1) want += 32 - __builtin_clz(remaining - 1);
+        int source = 0;
+        if (want <= pool->max_rank) {
+            source = find_source(pool, rank, want, &top);
+        }
+        if (source == 0) {
+            unsigned int candidates = load_mask(pool) & ~((1u << rank) - 1);
+            if (candidates == 0) {
+                if (lf_flush(pool) + coalesce_pending(pool) > 0) continue;
+                break;
+            }
+            source = find_source(pool, rank, 31 - __builtin_clz(candidates),
+                                 &top);
+            if (source == 0) break;
+        }
+
+        int index = lowest_free(pool, source);
+        unlink_free(pool, index, source);
+
+        int block_pages = rank_pages(rank);
+        int source_pages = rank_pages(source);
+        int pieces = source_pages / block_pages;
+        if (pieces > remaining) pieces = remaining;
+        stat_add(pool, allocs[rank], pieces);
+        stat_add(pool, splits, source - rank);
+        for (int i = 0; i < pieces; i++) {
+            int head = index + i * block_pages;
+            store_meta(pool, head, PAGE_HEAD | rank);
+            out[done++] = head;
+        }
+        shared_add(pool->free_pages, -(long)pieces * block_pages);
+
+        // The tail starts on a block boundary and ends on a power of two,
+        // so its largest aligned pieces grow by one rank at a time
+        int offset = pieces * block_pages;
+        while (offset < source_pages) {
+            int tail_rank = __builtin_ctz(offset) + 1;
+            push_free(pool, index + offset, tail_rank);
+            offset += rank_pages(tail_rank);
+        }
+
+        unlock_ranks(pool, rank, top);
+    }
+
+    pool_unlock(pool);
+    return done;
+}
+
+// Constrained allocation. A block of rank qualifies when its first page is
+// off modulo need and it ends at or below page limit. need is a power of
+// two no smaller than the block and off a multiple of the block, so a free
+// block holds at most one fit per need pages, at a fixed offset.
+
+// Helper function to find the fit inside the free block at index of rank
+// source, or NO_PAGE
+static int constrained_fit(int index, int source, int rank, int off, int need,
+                           int limit) {
+    int delta = (off - index) & (need - 1);
+    if (delta >= rank_pages(source) ||
+        index + delta > limit - rank_pages(rank)) {
+        return NO_PAGE;
+    }
+    return index + delta;
+}
+
+// Helper function to find a free block of rank source that holds a fit,
+// storing the fit in *target. The caller holds the lock of the rank, which
+// is non-empty.
+static int constrained_source(struct buddy_pool *pool, int source, int rank,
+                              int off, int need, int limit, int *target) {
+#if BUDDY_ADDR_ORDER
+    // Blocks of need pages or more all hold a fit at the same offset, so
+    // the lowest one is the only one worth checking
+    int pages = rank_pages(source);
+    if (pages >= need) {
+        int index = lowest_free(pool, source);
+        *target = constrained_fit(index, source, rank, off, need, limit);
+        return *target == NO_PAGE ? NO_PAGE : index;
+    }
+
+    // A smaller one holds a fit only if it sits in the right slot of
+    // every need pages, and then at off within itself. Jump from one slot
+    // to the next, letting the tree skip the empty stretches in between.
+    long step = need / pages, first = off / pages;
+    int inside = off & (pages - 1);
+    for (long bit = first; (bit = addr_next(pool, source, bit)) >= 0;) {
+        int index = bit << (source - 1);
+        if (index + inside > limit - rank_pages(rank)) break;
+        if (((bit - first) & (step - 1)) == 0) {
+            *target = index + inside;
+            return index;
+        }
+        bit = first + (((bit - first) | (step - 1)) + 1);
+    }
+    return NO_PAGE;
+#else
+    // Without the bitmaps the list is the only index. When any block will
+    // do, as without an address limit once need fits the rank, its first
+    // entry is taken.
+    for (int index = pool->free_lists[source]; index != NO_PAGE;
+         index = pool->page_links[index].next) {
+        *target = constrained_fit(index, source, rank, off, need, limit);
+        if (*target != NO_PAGE) return index;
+    }
+    return NO_PAGE;
+#endif
+}
+
+// Helper function to find a free block of rank source holding a fit and
+// lock the ranks a split of it touches. The search holds the lock of that
+// rank alone, so a long list stalls no other; once the path is locked the
+// block is looked at again, and sought anew if it was taken meanwhile.
+// Returns NO_PAGE holding no rank lock if the rank has no fit.
+static int lock_constrained(struct buddy_pool *pool, int source, int rank,
+                            int off, int need, int limit, int *target) {
+    for (;;) {
+        rank_lock(pool, source);
+        int index = NO_PAGE;
+        if (pool->free_lists[source] != NO_PAGE) {
+            index = constrained_source(pool, source, rank, off, need, limit,
+                                       target);
+        }
+        rank_unlock(pool, source);
+        if (index == NO_PAGE) {
+            return NO_PAGE;
+        }
+
+        for (int r = rank; r <= source; r++) rank_lock(pool, r);
+        if (load_meta(pool, index) == (PAGE_HEAD | PAGE_FREE | source)) {
+            return index;
+        }
+        unlock_ranks(pool, rank, source);
+    }
+}
+
+// Helper function to take a block of a valid rank that fits a constraint,
+// from the smallest rank holding one so as little as possible is split
+static int alloc_constrained(struct buddy_pool *pool, int rank, int off,
+                             int need, int limit) {
+    int index = NO_PAGE, target = NO_PAGE, source;
+    pool_lock(pool);
+
+    if (below_min(pool, rank_pages(rank)) &&
+        (lf_flush(pool) == 0 || below_min(pool, rank_pages(rank)))) {
+        pool_unlock(pool);
+        return NO_PAGE;
+    }
+
+    for (int retried = 0;; retried = 1) {
+        for (source = rank; source <= pool->max_rank; source++) {
+            index = lock_constrained(pool, source, rank, off, need, limit,
+                                     &target);
+            if (index != NO_PAGE) break;
+        }
+        if (index != NO_PAGE) break;
+        if (retried || lf_flush(pool) + coalesce_pending(pool) == 0) {
+            pool_unlock(pool);
+            return NO_PAGE;
+        }
+    }
+    stat_add(pool, allocs[rank], 1);
+    stat_add(pool, splits, source - rank);
+
+    unlink_free(pool, index, source);
+    split_block(pool, index, source, target, rank);
+    store_meta(pool, target, PAGE_HEAD | rank);
+    shared_add(pool->free_pages, -rank_pages(rank));
+
+    unlock_ranks(pool, rank, source);
+    pool_unlock(pool);
+    return target;
+}
+
+// Helper function to insert a block at a rank and merge it with its free
+// buddies. The caller holds the pool lock; rank locks are taken here.
+//
+// With a release rank set, every free block at or above it holds no
+// memory. A block that ends up there is released up front, together with
+// the buddies below the release rank it absorbed; the ones above already
+// were.
+static void merge_free(struct buddy_pool *pool, int index, int rank) {
+    int freed = index, freed_rank = rank, release = pool->release_rank;
+    rank_lock(pool, rank);
+
+    if (pool->mode & BUDDY_MODE_LAZY) {
+        if (release != 0 && rank >= release) release_block(pool, index, rank);
+        push_free(pool, index, rank);
+        shared_add(pool->free_pages, rank_pages(rank));
+        shared_add(pool->lazy_pending, 1);
+        rank_unlock(pool, rank);
+        return;
+    }
+
+    // Try to merge with buddies
+    while (rank < pool->max_rank) {
+        int buddy = buddy_pfn(index, rank);
+
+        // The buddy of a tail block may lie past the end of the memory
+        if ((unsigned int)buddy >= (unsigned int)pool->total_pages) {
+            break;
+        }
+
+        // The buddy is mergeable only if it is a free block of the same rank
+        if (load_meta(pool, buddy) != (PAGE_HEAD | PAGE_FREE | rank)) {
+            break;
+        }
+
+        unlink_free(pool, buddy, rank);
+
+        // The merged block starts at the lower of the two, which has the
+        // rank bit clear; the upper one becomes an interior page
+        store_meta(pool, index | rank_pages(rank), 0);
+        index &= ~rank_pages(rank);
+        rank_lock(pool, rank + 1);
+        rank_unlock(pool, rank);
+        rank++;
+        stat_add(pool, merges, 1);
+    }
+
+    if (release != 0 && rank >= release) {
+        int span = freed_rank > release ? freed_rank : release;
+        release_block(pool, freed & ~(rank_pages(span) - 1), span);
+    }
+
+    // Add merged block to free list. The pages count as free from here,
+    // under the lock of the rank they land on, as a split counts them
+    // taken under the locks it holds.
+    push_free(pool, index, rank);
+    shared_add(pool->free_pages, rank_pages(freed_rank));
+
+    rank_unlock(pool, rank);
+}
+
+// Helper function for debug mode to cross-check an allocated block that
+// is about to be freed against the metadata around it, then poison it
+static int check_block(struct buddy_pool *pool, int index, int rank) {
+    if (!(pool->mode & BUDDY_MODE_DEBUG)) {
+        return OK;
+    }
+
+    int pages = rank_pages(rank);
+    if ((index & (pages - 1)) != 0 || pages > pool->total_pages - index) {
+        return -EINVAL;
+    }
+
+    // Interior pages never carry a descriptor
+    for (int i = 1; i < pages; i++) {
+        if (load_meta(pool, index + i) != 0) return -EINVAL;
+    }
+
+    // The buddy starts on a boundary of this rank, so whatever covers it
+    // must be a block of this rank or below with its head right there
+    int buddy = buddy_pfn(index, rank);
+    if ((unsigned int)buddy < (unsigned int)pool->total_pages) {
+        unsigned char meta = load_meta(pool, buddy);
+        if (!(meta & PAGE_HEAD) || (meta & PAGE_RANK_MASK) > rank) {
+            return -EINVAL;
+        }
+    }
+
+    memset(pfn_to_addr(pool, index), PAGE_POISON,
+           (size_t)pages << BUDDY_PAGE_SHIFT);
+    return OK;
+}
+
+// Helper function to claim the head of an allocated block for freeing and
+// return its rank. The descriptor is marked PAGE_CACHED with a CAS, so of
+// two frees racing on one block only one gets past here, and the free
+// lists keep treating the block as allocated until it reaches them.
+static int claim_block(struct buddy_pool *pool, int index) {
+    if (index == NO_PAGE) {
+        return -EINVAL;
+    }
+
+    // Only the head of an allocated block may be returned
+    unsigned char meta = load_meta(pool, index);
+    do {
+        if ((meta & (PAGE_HEAD | PAGE_FREE | PAGE_CACHED)) != PAGE_HEAD) {
+            return -EINVAL;
+        }
+    } while (!__atomic_compare_exchange_n(&pool->page_meta[index], &meta,
+                                          meta | PAGE_CACHED, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    int rank = meta & PAGE_RANK_MASK;
+    if (check_block(pool, index, rank) < 0) {
+        store_meta(pool, index, meta);
+        return -EINVAL;
+    }
+    return rank;
+}
+
+// Helper function to free a claimed block through the caches or the free
+// lists
+static void free_claimed(struct buddy_pool *pool, int index, int rank) {
+#if BUDDY_TAGS
+    drop_tag(pool, index, rank);
+#endif
+#if BUDDY_PCP
+    if (rank <= BUDDY_PCP_MAX_RANK) {
+        pcp_free(pool, index, rank);
+        return;
+    }
+#elif BUDDY_LOCKFREE
+    if (rank == 1) {
+        lf_free(pool, index);
+        return;
+    }
+#endif
+
+    free_block(pool, index, rank);
+}
+
+// Return pages to the buddy system
+int buddy_free(struct buddy_pool *pool, void *p) {
+    int index = head_pfn(pool, p);
+    int rank = claim_block(pool, index), ret = -EINVAL;
+    if (rank > 0) {
+        free_claimed(pool, index, rank);
+        ret = OK;
+    }
+    check_watermarks(pool);
+    if (tracing(pool)) {
+        trace_put(pool, ret == OK ? TRACE_FREE : TRACE_FREE_FAIL, 0,
+                  index == NO_PAGE ? pool->total_pages : index, 0);
+    }
+    return ret;
+}
+
+// Helper function to give a block back to the free lists and merge it
+static void free_block(struct buddy_pool *pool, int index, int rank) {
+    pool_lock(pool);
+    merge_free(pool, index, rank);
+    stat_add(pool, frees[rank], 1);
+    pool_unlock(pool);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct bulk_entry *x = a, *y = b;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Helper function to free a batch of allocated blocks, claimed or parked
+// with PAGE_CACHED so no free can race them. Buddies within the batch are
+// paired up first, so each subtree reaches the free lists only once;
+// repeated entries are skipped. The caller holds the pool lock; returns
+// the number of blocks freed.
+static int free_entries(struct buddy_pool *pool, struct bulk_entry *batch,
+                        int count) {
+    qsort(batch, count, sizeof(batch[0]), compare_entries);
+
+    // In address order a block can only pair with the entry below it,
+    // so the batch folds up like a stack
+    int depth = 0, last = NO_PAGE, freed = 0;
+    for (int i = 0; i < count; i++) {
+        if (batch[i].index == last) continue;
+        last = batch[i].index;
+        batch[depth++] = batch[i];
+        freed++;
+        stat_add(pool, frees[batch[i].rank], 1);
+        while (depth >= 2) {
+            struct bulk_entry *low = &batch[depth - 2];
+            struct bulk_entry *high = &batch[depth - 1];
+            if (low->rank != high->rank || low->rank >= pool->max_rank ||
+                buddy_pfn(low->index, low->rank) != high->index) {
+                break;
+            }
+            // Under the rank lock, as in merge_free, so the tiling never
+            // looks torn to buddy_verify
+            rank_lock(pool, low->rank);
+            store_meta(pool, high->index, 0);
+            store_meta(pool, low->index,
+                       PAGE_HEAD | PAGE_CACHED | (low->rank + 1));
+            rank_unlock(pool, low->rank);
+            low->rank++;
+            depth--;
+            stat_add(pool, merges, 1);
+        }
+    }
+
+    for (int i = 0; i < depth; i++) {
+        merge_free(pool, batch[i].index, batch[i].rank);
+    }
+    return freed;
+}
+
+// Allocate up to n blocks of the specified rank into out. Returns the
+// number of blocks filled from out[0] on, which falls short of n when the
+// pool runs out or reaches its min watermark partway, as it may when other
+// threads take blocks meanwhile. Callers must handle a short count, and
+// free what they got if they need all or nothing. Returns -ENOSPC if not
+// even one block was found.
+int buddy_alloc_bulk(struct buddy_pool *pool, int rank, int n, void **out) {
+    if (rank < 1 || rank > MAX_RANK || n < 0 || (n > 0 && out == NULL)) {
+        return -EINVAL;
+    }
+
+    if (pool->memory_base == NULL || rank > pool->max_rank) {
+        return n == 0 ? 0 : -ENOSPC;
+    }
+
+#if BUDDY_TAGS
+    // Charge the whole request up front and refund what was not granted
+    if (!charge_tag(pool, 0, (long)n * rank_pages(rank))) {
+        return -EDQUOT;
+    }
+#endif
+
+    int pfns[BULK_CHUNK];
+    int done = 0, drained = 0;
+    while (done < n) {
+        int want = n - done < BULK_CHUNK ? n - done : BULK_CHUNK;
+        int got = alloc_bulk(pool, rank, want, pfns);
+        for (int i = 0; i < got; i++) {
+#if BUDDY_TAGS
+            pool->page_tags[pfns[i]] = 0;
+#endif
+            out[done++] = pfn_to_addr(pool, pfns[i]);
+        }
+        if (got < want && (drained++ || pcp_drain_all(pool) == 0)) break;
+    }
+    if (done < n) note_failure(pool, rank);
+
+    // Recorded as the single allocations it stands for, up to the first
+    // that failed
+    if (tracing(pool)) {
+        for (int i = 0; i < done; i++) {
+            trace_put(pool, TRACE_ALLOC, rank, trace_page(pool, out[i]), 0);
+        }
+        if (done < n) trace_put(pool, TRACE_ALLOC_FAIL, rank, NO_PAGE, 0);
+    }
+#if BUDDY_TAGS
+    uncharge_tag(pool, 0, (long)(n - done) * rank_pages(rank));
+#endif
+    check_watermarks(pool);
+    return done == 0 && n > 0 ? -ENOSPC : done;
 }
 
-// Helper function to check if an address is within the managed memory
-static int is_valid_address(void *addr) {
-    if (memory_base == NULL) return 0;
-    if (addr < memory_base) return 0;
-    if (addr >= (char *)memory_base + total_pages * PAGE_SIZE) return 0;
-    return 1;
-}
+// Allocate a block of the specified rank whose address is a multiple of
+// the size of a rank align_rank block, 0 for no more than the pool's own
+// alignment, and which lies wholly below max_addr, NULL for no limit.
+// Served from the free lists only, bypassing the per-CPU caches.
+void *buddy_alloc_constrained(struct buddy_pool *pool, int rank,
+                              int align_rank, void *max_addr) {
+    if (rank < 1 || rank > MAX_RANK || align_rank < 0 ||
+        align_rank > MAX_RANK) {
+        return ERR_PTR(-EINVAL);
+    }
 
-// Helper function to get the offset of an address
-static size_t get_offset(void *addr) {
-    return (char *)addr - (char *)memory_base;
-}
+    if (pool->memory_base == NULL) {
+        return ERR_PTR(-ENOSPC);
+    }
+
+    // Turn the address constraints into pages of the pool: the first page
+    // must be off modulo need, where a base off the alignment shifts off
+    uintptr_t base = (uintptr_t)pool->memory_base;
+    int need = rank_pages(rank), off = 0, limit = pool->total_pages;
+    if (align_rank > 0) {
+        uintptr_t align = (uintptr_t)PAGE_SIZE << (align_rank - 1);
+        uintptr_t skew = -base & (align - 1);
+        if (need < rank_pages(align_rank)) need = rank_pages(align_rank);
+        off = skew >> BUDDY_PAGE_SHIFT;
+        if ((skew & (PAGE_SIZE - 1)) != 0 || (off & (rank_pages(rank) - 1))) {
+            limit = 0;
+        }
+    }
+    // The trace keeps the limit as asked, before any alignment veto
+    int asked = pool->total_pages;
+    if (max_addr != NULL) {
+        uintptr_t below = (uintptr_t)max_addr > base
+                              ? ((uintptr_t)max_addr - base) >> BUDDY_PAGE_SHIFT
+                              : 0;
+        if (below < (uintptr_t)asked) asked = below;
+        if (asked < limit) limit = asked;
+    }
+
+    if (rank > pool->max_rank || limit < rank_pages(rank)) {
+        note_failure(pool, rank);
+        if (tracing(pool)) {
+            trace_constrained(pool, rank, align_rank, asked, NO_PAGE);
+        }
+        return ERR_PTR(-ENOSPC);
+    }
+
+#if BUDDY_TAGS
+    if (!charge_tag(pool, 0, rank_pages(rank))) {
+        if (tracing(pool)) {
+            trace_constrained(pool, rank, align_rank, asked, NO_PAGE);
+        }
+        return ERR_PTR(-EDQUOT);
+    }
+#endif
+
+    int pfn = alloc_constrained(pool, rank, off, need, limit);
+    if (pfn == NO_PAGE && pcp_drain_all(pool) > 0) {
+        pfn = alloc_constrained(pool, rank, off, need, limit);
+    }
+    if (pfn == NO_PAGE) note_failure(pool, rank);
 
-// Helper function to get the address from offset
-static void *get_address(size_t offset) {
-    return (char *)memory_base + offset;
+#if BUDDY_TAGS
+    if (pfn == NO_PAGE) {
+        uncharge_tag(pool, 0, rank_pages(rank));
+    } else {
+        pool->page_tags[pfn] = 0;
+    }
+#endif
+    void *p = pfn == NO_PAGE ? ERR_PTR(-ENOSPC) : pfn_to_addr(pool, pfn);
+    check_watermarks(pool);
+    if (tracing(pool)) trace_constrained(pool, rank, align_rank, asked, pfn);
+    return p;
 }
 
-// Helper function to calculate buddy address
-static void *get_buddy(void *addr, int rank) {
-    size_t offset = get_offset(addr);
-    size_t buddy_offset = offset ^ rank_to_size(rank);
-    return get_address(buddy_offset);
+// Helper function to record a batch of a bulk free as the single frees it
+// stands for. A block given twice was already refused by claim_block.
+static void trace_entries(struct buddy_pool *pool, struct bulk_entry *batch,
+                          int count) {
+    for (int i = 0; i < count; i++) {
+        trace_put(pool, TRACE_FREE, 0, batch[i].index, 0);
+    }
 }
 
-// Initialize the buddy system
-int init_page(void *p, int pgcount) {
-    if (p == NULL || pgcount <= 0) {
+// Return n blocks to the buddy system
+int buddy_free_bulk(struct buddy_pool *pool, void **pages, int n) {
+    if (n < 0 || (n > 0 && pages == NULL)) {
         return -EINVAL;
     }
 
-    memory_base = p;
-    total_pages = pgcount;
-
-    // Initialize free lists
-    for (int i = 1; i <= MAX_RANK; i++) {
-        free_lists[i] = NULL;
+    // Entries that are not allocated block heads are skipped
+    struct bulk_entry batch[BULK_CHUNK];
+    int returned = 0;
+    pool_lock(pool);
+    for (int start = 0; start < n; start += BULK_CHUNK) {
+        int count = 0;
+        for (int i = start; i < n && i < start + BULK_CHUNK; i++) {
+            int index = head_pfn(pool, pages[i]);
+            int rank = claim_block(pool, index);
+            if (rank < 0) {
+                if (tracing(pool)) {
+                    trace_put(pool, TRACE_FREE_FAIL, 0,
+                              trace_page(pool, pages[i]), 0);
+                }
+                continue;
+            }
+#if BUDDY_TAGS
+            drop_tag(pool, index, rank);
+#endif
+            batch[count].index = index;
+            batch[count].rank = rank;
+            count++;
+        }
+        if (tracing(pool)) trace_entries(pool, batch, count);
+        returned += free_entries(pool, batch, count);
     }
+    pool_unlock(pool);
+    check_watermarks(pool);
 
-    // Calculate the maximum rank that fits in the available memory
-    max_rank = 1;
-    size_t current_size = PAGE_SIZE;
-    while (current_size <= total_pages * PAGE_SIZE && max_rank < MAX_RANK) {
-        max_rank++;
-        current_size *= 2;
-    }
-    max_rank--;  // Adjust to the largest rank that fits
+    return returned;
+}
 
-    // Add the entire memory as one free block of maximum possible rank
-    struct block_header *header = (struct block_header *)memory_base;
-    header->rank = max_rank;
-    header->next = free_lists[max_rank];
-    free_lists[max_rank] = header;
+// Query the rank of a page
+int buddy_query_rank(struct buddy_pool *pool, void *p) {
+    size_t index = addr_to_pfn(pool, p);
+    int rank = -EINVAL;
+    if (p != NULL && index < (size_t)pool->total_pages) {
+        // Free and allocated blocks both answer with the rank of their head
+        pool_lock(pool);
+        if (pool->mode & BUDDY_MODE_STRICT) coalesce_pending(pool);
+        int head = find_block_head(pool, index);
+        if (head != NO_PAGE) rank = load_meta(pool, head) & PAGE_RANK_MASK;
+        pool_unlock(pool);
+    }
 
-    return OK;
+    if (tracing(pool)) {
+        trace_put(pool, TRACE_RANK, rank, trace_page(pool, p), 0);
+    }
+    return rank;
 }
 
-// Allocate pages of specified rank
-void *alloc_pages(int rank) {
+// Query how many unallocated pages remain for the specified rank
+int buddy_query_count(struct buddy_pool *pool, int rank) {
+    int count = 0;
     if (rank < 1 || rank > MAX_RANK) {
-        return ERR_PTR(-EINVAL);
+        count = -EINVAL;
+    } else if (pool->memory_base != NULL && rank <= pool->max_rank) {
+        pool_lock(pool);
+        if (pool->mode & BUDDY_MODE_STRICT) coalesce_pending(pool);
+        rank_lock(pool, rank);
+        count = pool->free_counts[rank];
+        rank_unlock(pool, rank);
+        pool_unlock(pool);
     }
 
-    if (memory_base == NULL) {
-        return ERR_PTR(-ENOSPC);
+    if (tracing(pool)) {
+        trace_put(pool, TRACE_COUNT, rank, NO_PAGE, count);
     }
+    return count;
+}
 
-    if (rank > max_rank) {
-        return ERR_PTR(-ENOSPC);
+// Query the ranks of n pages into out, -EINVAL for pages outside the
+// pool, under a single lock. Page numbers are computed for the whole
+// batch first, in a loop the compiler vectorizes given 64-bit vector
+// compares (AVX2 on x86); block heads, the usual argument, then answer
+// from their own descriptor.
+int buddy_query_rank_bulk(struct buddy_pool *pool, void **pages, int n,
+                          int *out) {
+    if (n < 0 || (n > 0 && (pages == NULL || out == NULL))) {
+        return -EINVAL;
     }
 
-    // Find the smallest rank that has a free block
-    int current_rank = rank;
-    while (current_rank <= max_rank && free_lists[current_rank] == NULL) {
-        current_rank++;
+    uintptr_t base = (uintptr_t)pool->memory_base;
+    size_t total = pool->total_pages;
+    for (int i = 0; i < n; i++) {
+        size_t pfn = ((uintptr_t)pages[i] - base) >> BUDDY_PAGE_SHIFT;
+        out[i] = pfn < total ? (int)pfn : NO_PAGE;
     }
 
-    if (current_rank > max_rank) {
-        return ERR_PTR(-ENOSPC);
+    pool_lock(pool);
+    if (pool->mode & BUDDY_MODE_STRICT) coalesce_pending(pool);
+    for (int i = 0; i < n; i++) {
+        int index = out[i];
+        if (index == NO_PAGE) {
+            out[i] = -EINVAL;
+            continue;
+        }
+        unsigned char meta = load_meta(pool, index);
+        if (!(meta & PAGE_HEAD)) {
+            int head = find_block_head(pool, index);
+            meta = head == NO_PAGE ? 0 : load_meta(pool, head);
+        }
+        out[i] = meta & PAGE_HEAD ? meta & PAGE_RANK_MASK : -EINVAL;
     }
+    pool_unlock(pool);
+
+    return n;
+}
 
-    // Split blocks until we get the desired rank
-    while (current_rank > rank) {
-        // Remove block from current rank
-        struct block_header *block = free_lists[current_rank];
-        free_lists[current_rank] = block->next;
+// Query the free block count of every rank into out[1..BUDDY_MAX_RANK] as
+// one consistent snapshot; out[0] is set to 0
+int buddy_query_counts(struct buddy_pool *pool, int out[BUDDY_MAX_RANK + 1]) {
+    if (out == NULL) {
+        return -EINVAL;
+    }
 
-        // Split into two blocks of lower rank
-        int new_rank = current_rank - 1;
-        size_t block_size = rank_to_size(new_rank);
+    memset(out, 0, (MAX_RANK + 1) * sizeof(int));
+    if (pool->memory_base == NULL) {
+        return OK;
+    }
 
-        // Create first buddy
-        struct block_header *buddy1 = block;
-        buddy1->rank = new_rank;
-        buddy1->next = free_lists[new_rank];
-        free_lists[new_rank] = buddy1;
+    pool_lock(pool);
+    if (pool->mode & BUDDY_MODE_STRICT) coalesce_pending(pool);
+    for (int rank = 1; rank <= pool->max_rank; rank++) rank_lock(pool, rank);
+    memcpy(out + 1, pool->free_counts + 1, pool->max_rank * sizeof(int));
+    unlock_ranks(pool, 1, pool->max_rank);
+    pool_unlock(pool);
 
-        // Create second buddy
-        struct block_header *buddy2 = (struct block_header *)((char *)block + block_size);
-        buddy2->rank = new_rank;
-        buddy2->next = free_lists[new_rank];
-        free_lists[new_rank] = buddy2;
+    return OK;
+}
 
-        current_rank = new_rank;
+// Select the BUDDY_MODE_* behaviour of a pool. Leaving lazy mode merges
+// everything that was deferred.
+int buddy_set_mode(struct buddy_pool *pool, unsigned int mode) {
+    if (mode & ~(BUDDY_MODE_LAZY | BUDDY_MODE_STRICT | BUDDY_MODE_DEBUG)) {
+        return -EINVAL;
     }
 
-    // Allocate the block
-    struct block_header *alloc_block = free_lists[rank];
-    free_lists[rank] = alloc_block->next;
+    pool_lock(pool);
+    pool->mode = mode;
+    if (!(mode & BUDDY_MODE_LAZY)) coalesce_pending(pool);
+    pool_unlock(pool);
+    return OK;
+}
 
-    // Return the data area (after the header)
-    return (char *)alloc_block + sizeof(struct block_header);
+// Merge every free buddy pair left behind by lazy mode
+int buddy_coalesce(struct buddy_pool *pool) {
+    pool_lock(pool);
+    int merged = coalesce_pending(pool);
+    pool_unlock(pool);
+    return merged;
 }
 
-// Return pages to the buddy system
-int return_pages(void *p) {
-    if (p == NULL || !is_valid_address(p)) {
+// Give the memory of free blocks of the specified rank and above back to
+// the kernel, now and whenever frees merge into such blocks, so resident
+// memory follows what is allocated. 0 keeps every page, as by default.
+// Blocks handed out afterwards may start out uncommitted; they fault in
+// on first touch. Must not race with other calls on the pool.
+int buddy_set_release_rank(struct buddy_pool *pool, int rank) {
+    if (rank < 0 || rank > MAX_RANK) {
+        return -EINVAL;
+    }
+
+    pool_lock(pool);
+    for (int r = 1; r <= pool->max_rank; r++) rank_lock(pool, r);
+    pool->release_rank = rank;
+    for (int r = rank == 0 ? pool->max_rank + 1 : rank; r <= pool->max_rank;
+         r++) {
+        for (int index = pool->free_lists[r]; index != NO_PAGE;
+             index = pool->page_links[index].next) {
+            release_block(pool, index, r);
+        }
+    }
+    unlock_ranks(pool, 1, pool->max_rank);
+    pool_unlock(pool);
+    return OK;
+}
+
+// Set the watermarks of a pool, in free pages, with min <= low <= high.
+// Allocations leave at least min pages free, so the callback has a reserve
+// to work with. A fall below low calls fn once, until the pool climbs back
+// to high, so a cache can shed pages before allocations fail; a request
+// that does fail calls it as well. A NULL fn disables the callbacks.
+int buddy_set_watermarks(struct buddy_pool *pool, long min, long low,
+                         long high, buddy_watermark_fn fn, void *arg) {
+    if (min < 0 || low < min || high < low) {
         return -EINVAL;
     }
 
-    if (memory_base == NULL) {
+    pool_lock(pool);
+    // Read without the lock by allocations and frees
+    __atomic_store_n(&pool->wmark_min, min, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->wmark_low, low, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->wmark_high, high, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->wmark_fired, 0, __ATOMIC_RELAXED);
+    // The callback in the order wmark_callback relies on
+    __atomic_store_n(&pool->wmark_fn, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->wmark_arg, arg, __ATOMIC_RELEASE);
+    __atomic_store_n(&pool->wmark_fn, fn, __ATOMIC_RELEASE);
+    pool_unlock(pool);
+    return OK;
+}
+
+// Query the pages on the free lists, as the watermarks see them
+long buddy_free_pages(struct buddy_pool *pool) {
+    return __atomic_load_n(&pool->free_pages, __ATOMIC_RELAXED);
+}
+
+// Limit the pages a tag may hold, 0 for no limit. Allocations that would
+// take it over get -EDQUOT; pages already held are not affected.
+int buddy_set_tag_limit(struct buddy_pool *pool, int tag, long pages) {
+#if BUDDY_TAGS
+    if (tag < 0 || tag >= BUDDY_TAGS || pages < 0) {
         return -EINVAL;
     }
 
-    // Get the block header (before the data area)
-    struct block_header *block = (struct block_header *)((char *)p - sizeof(struct block_header));
+    pool->tag_limits[tag] = pages;
+    return OK;
+#else
+    (void)pool;
+    (void)tag;
+    (void)pages;
+    return -EINVAL;
+#endif
+}
 
-    // Check if this block was actually allocated
-    if (!is_valid_address(block)) {
+// Query the pages held under each tag into out[0..BUDDY_TAGS-1]. Blocks
+// parked in per-CPU caches are no longer charged to anyone.
+int buddy_query_tags(struct buddy_pool *pool, long *out) {
+#if BUDDY_TAGS
+    if (out == NULL) {
         return -EINVAL;
     }
 
-    int rank = 1; // We need to determine the actual rank
-    // For now, we'll assume rank 1 for simplicity
-    // In a complete implementation, we would track the allocation rank
+    for (int tag = 0; tag < BUDDY_TAGS; tag++) {
+        out[tag] = __atomic_load_n(&pool->tag_pages[tag], __ATOMIC_RELAXED);
+    }
+    return OK;
+#else
+    (void)pool;
+    (void)out;
+    return -EINVAL;
+#endif
+}
+
+// Compaction. A window is an aligned run of pages the size of the rank
+// being rebuilt. Its free blocks are isolated first: taken off the free
+// lists and parked with PAGE_CACHED, so neither allocations nor merges
+// reach them. Its allocated blocks are then moved out one at a time
+// through the relocation callback, and each vacated block is parked too.
+// Finally everything parked is freed in one batch, which folds the window
+// back up into a single block unless a move was refused.
 
-    // Add to free list
-    block->rank = rank;
-    block->next = free_lists[rank];
-    free_lists[rank] = block;
+// Helper function to park an isolated or vacated block on a list threaded
+// through page_links, which allocated blocks do not use
+static void park_block(struct buddy_pool *pool, int index, int rank,
+                       int *parked) {
+    store_meta(pool, index, PAGE_HEAD | PAGE_CACHED | rank);
+    pool->page_links[index].next = *parked;
+    *parked = index;
+}
 
-    // Try to merge with buddies
-    while (rank < max_rank) {
-        void *buddy_addr = get_buddy(block, rank);
-
-        // Check if buddy exists and is free
-        struct block_header **prev = &free_lists[rank];
-        struct block_header *current = free_lists[rank];
-        struct block_header *buddy_block = NULL;
-
-        while (current != NULL) {
-            if (current == buddy_addr) {
-                buddy_block = current;
-                // Remove buddy from free list
-                *prev = current->next;
-                break;
-            }
-            prev = &current->next;
-            current = current->next;
+// Helper function to free every parked block, merging
+static void release_parked(struct buddy_pool *pool, int parked) {
+    struct bulk_entry batch[BULK_CHUNK];
+    int count = 0;
+    pool_lock(pool);
+    while (parked != NO_PAGE) {
+        int next = pool->page_links[parked].next;
+        int rank = load_meta(pool, parked) & PAGE_RANK_MASK;
+        batch[count].index = parked;
+        batch[count].rank = rank;
+        if (++count == BULK_CHUNK) {
+            free_entries(pool, batch, count);
+            count = 0;
         }
+        parked = next;
+    }
+    free_entries(pool, batch, count);
+    // Lazy mode leaves the merges across batches for this pass
+    coalesce_pending(pool);
+    pool_unlock(pool);
+}
 
-        if (buddy_block == NULL) {
-            break;  // No buddy to merge with
+// Helper function to count the allocated pages of a window, or -1 if it is
+// not worth compacting: a block in it is parked or at least as large as
+// the window, or its pages would not fit the budget or the free pages
+// outside it. The caller holds the pool lock.
+static int window_cost(struct buddy_pool *pool, int start, int rank,
+                       int budget) {
+    int used = 0, unused = 0, end = start + rank_pages(rank);
+    for (int index = start; index < end;) {
+        unsigned char meta = load_meta(pool, index);
+        if (!(meta & PAGE_HEAD) || (meta & PAGE_CACHED) ||
+            (meta & PAGE_RANK_MASK) >= rank) {
+            return -1;
+        }
+        int pages = rank_pages(meta & PAGE_RANK_MASK);
+        if (meta & PAGE_FREE) {
+            unused += pages;
+        } else {
+            used += pages;
         }
+        index += pages;
+    }
+    if (used > budget || used > count_free(pool, NULL) - unused) {
+        return -1;
+    }
+    return used;
+}
 
-        // Remove the current block from free list
-        prev = &free_lists[rank];
-        current = free_lists[rank];
-        while (current != NULL) {
-            if (current == block) {
-                *prev = current->next;
-                break;
+// Helper function to isolate the free blocks of a window onto *parked.
+// Returns 0 if a block changed since window_cost looked at it. The caller
+// holds the pool lock.
+static int isolate_window(struct buddy_pool *pool, int start, int rank,
+                          int *parked) {
+    int end = start + rank_pages(rank);
+    for (int index = start; index < end;) {
+        unsigned char meta = load_meta(pool, index);
+        if (!(meta & PAGE_HEAD)) {
+            return 0;
+        }
+        int block_rank = meta & PAGE_RANK_MASK;
+        if (meta & PAGE_FREE) {
+            rank_lock(pool, block_rank);
+            int same = load_meta(pool, index) == meta;
+            if (same) {
+                unlink_free(pool, index, block_rank);
+                park_block(pool, index, block_rank, parked);
+                shared_add(pool->free_pages, -rank_pages(block_rank));
             }
-            prev = &current->next;
-            current = current->next;
+            rank_unlock(pool, block_rank);
+            if (!same) return 0;
+        }
+        index += rank_pages(block_rank);
+    }
+    return 1;
+}
+
+// Helper function to find the next allocated block of a window at or after
+// index, or NO_PAGE. Blocks freed meanwhile may have merged into a larger
+// block, so a page that is no longer a head is skipped to the end of the
+// block covering it.
+static int next_movable(struct buddy_pool *pool, int index, int end,
+                        int *rank) {
+    pool_lock(pool);
+    while (index < end) {
+        unsigned char meta = load_meta(pool, index);
+        if (!(meta & PAGE_HEAD)) {
+            int head = find_block_head(pool, index);
+            if (head == NO_PAGE) break;
+            int next = head + rank_pages(load_meta(pool, head) &
+                                         PAGE_RANK_MASK);
+            index = next > index ? next : index + 1;
+            continue;
         }
+        if (!(meta & (PAGE_FREE | PAGE_CACHED))) {
+            *rank = meta & PAGE_RANK_MASK;
+            pool_unlock(pool);
+            return index;
+        }
+        index += rank_pages(meta & PAGE_RANK_MASK);
+    }
+    pool_unlock(pool);
+    return NO_PAGE;
+}
 
-        // Merge the two buddies
-        rank++;
-        // The merged block is the one with lower address
-        if (block > buddy_block) {
-            block = buddy_block;
+// Helper function to empty one window, moving at most budget pages out.
+// Returns the pages moved.
+static int compact_window(struct buddy_pool *pool, int start, int rank,
+                          int budget, buddy_relocate_fn relocate, void *arg) {
+    int parked = NO_PAGE;
+    pool_lock(pool);
+    if (window_cost(pool, start, rank, budget) < 0) {
+        pool_unlock(pool);
+        return 0;
+    }
+    int isolated = isolate_window(pool, start, rank, &parked);
+    pool_unlock(pool);
+
+    int moved = 0, end = start + rank_pages(rank), block_rank;
+    for (int index = start; isolated; index += rank_pages(block_rank)) {
+        index = next_movable(pool, index, end, &block_rank);
+        if (index == NO_PAGE || moved + rank_pages(block_rank) > budget) break;
+
+        // Other windows are fair game; this one's free blocks are parked
+        int to = alloc_block(pool, block_rank);
+        if (to == NO_PAGE) break;
+        if (relocate(pfn_to_addr(pool, index), pfn_to_addr(pool, to),
+                     block_rank, arg) != 0) {
+            free_block(pool, to, block_rank);
+            break;
         }
 
-        // Add merged block to free list
-        block->rank = rank;
-        block->next = free_lists[rank];
-        free_lists[rank] = block;
+        pool_lock(pool);
+#if BUDDY_TAGS
+        // The charge follows the contents
+        pool->page_tags[to] = pool->page_tags[index];
+        pool->page_tags[index] = NO_TAG;
+#endif
+        park_block(pool, index, block_rank, &parked);
+        pool_unlock(pool);
+        moved += rank_pages(block_rank);
     }
 
-    return OK;
+    release_parked(pool, parked);
+    stat_add(pool, compacted, moved);
+    return moved;
 }
 
-// Query the rank of a page
-int query_ranks(void *p) {
-    if (p == NULL || !is_valid_address(p)) {
+// Run a bounded step of compaction towards a free block of the specified
+// rank, moving at most budget pages. Windows are visited from where the
+// last call stopped, and those that would take the step over budget are
+// passed over, so a small budget goes to the emptiest windows. Stops once
+// a block of the rank is free or every window has been visited; returns
+// the pages moved.
+int buddy_compact(struct buddy_pool *pool, int rank, int budget,
+                  buddy_relocate_fn relocate, void *arg) {
+    if (rank < 1 || rank > MAX_RANK || budget <= 0 || relocate == NULL) {
         return -EINVAL;
     }
 
-    if (memory_base == NULL) {
-        return -EINVAL;
+    if (pool->memory_base == NULL || rank > pool->max_rank) {
+        return -ENOSPC;
     }
 
-    // For allocated pages, we need to track the allocation rank
-    // For now, we'll assume rank 1 for allocated pages
-    // In a complete implementation, we would track allocation information
+    // Parked and cached blocks cannot move, so return them first
+    buddy_drain(pool);
+    buddy_coalesce(pool);
 
-    // Check if the page is in any free list
-    for (int rank = 1; rank <= max_rank; rank++) {
-        struct block_header *current = free_lists[rank];
-        while (current != NULL) {
-            size_t block_size = rank_to_size(rank);
-            void *block_start = (char *)current + sizeof(struct block_header);
-            if (p >= block_start && p < (char *)block_start + block_size) {
-                return rank;  // Page is free, return its rank
-            }
-            current = current->next;
-        }
+    int pages = rank_pages(rank);
+    int windows = pool->total_pages / pages;
+    int moved = 0;
+    for (int i = 0; i < windows && moved < budget; i++) {
+        if (load_mask(pool) & ~((1u << rank) - 1)) break;
+
+        int start = __atomic_load_n(&pool->compact_cursor, __ATOMIC_RELAXED) &
+                    ~(pages - 1);
+        if (start + pages > pool->total_pages) start = 0;
+        __atomic_store_n(&pool->compact_cursor, start + pages,
+                         __ATOMIC_RELAXED);
+        moved += compact_window(pool, start, rank, budget - moved, relocate,
+                                arg);
     }
+    return moved;
+}
 
-    // If not found in free lists, it's allocated - return 1 for now
-    return 1;
+// Query the highest rank that currently has a free block, 0 if none
+int buddy_largest_free_rank(struct buddy_pool *pool) {
+    unsigned int mask = load_mask(pool);
+    return mask == 0 ? 0 : 31 - __builtin_clz(mask);
 }
 
-// Query how many unallocated pages remain for the specified rank
-int query_page_counts(int rank) {
+// Query the fragmentation index for an allocation of the specified rank,
+// as Linux computes it for extfrag: -1000 if a block is available now,
+// otherwise 0..1000, where values towards 0 mean the failure is due to a
+// lack of free pages and values towards 1000 mean it is due to
+// fragmentation
+int buddy_frag_index(struct buddy_pool *pool, int rank) {
     if (rank < 1 || rank > MAX_RANK) {
         return -EINVAL;
     }
 
-    if (memory_base == NULL) {
+    if (load_mask(pool) & ~((1u << rank) - 1)) {
+        return -1000;
+    }
+
+    long blocks;
+    long pages = count_free(pool, &blocks);
+    if (blocks == 0) {
+        return 0;
+    }
+
+    long requested = 1L << (rank - 1);
+    return 1000 - (1000 + pages * 1000 / requested) / blocks;
+}
+
+// Copy the allocator statistics of a pool into out
+int buddy_get_stats(struct buddy_pool *pool, struct buddy_stats *out) {
+    memset(out, 0, sizeof(*out));
+#if BUDDY_STATS
+    const unsigned long *src = (const unsigned long *)&pool->stats;
+    unsigned long *dst = (unsigned long *)out;
+    for (size_t i = 0; i < sizeof(*out) / sizeof(unsigned long); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    return OK;
+#else
+    (void)pool;
+    return -EINVAL;
+#endif
+}
+
+// Start recording the calls made on a pool into the size bytes at buf.
+// flush, if not NULL, is called with the trace lock held each time buf
+// fills, and for the rest by buddy_trace_stop. May run alongside other
+// calls on the pool, but not alongside another start.
+int buddy_trace_start(struct buddy_pool *pool, void *buf, size_t size,
+                      buddy_trace_flush_fn flush, void *arg) {
+    if (buf == NULL || size < 2 * TRACE_EVENT_MAX) {
+        return -EINVAL;
+    }
+
+    buddy_trace_stop(pool);
+    struct buddy_trace *trace = &pool->trace;
+    trace_lock(trace);
+    trace->size = size;
+    trace->used = 0;
+    trace->dropped = 0;
+    trace->flush = flush;
+    trace->arg = arg;
+    __atomic_store_n(&trace->buf, buf, __ATOMIC_RELAXED);
+    trace_unlock(trace);
+    trace_put(pool, TRACE_START, TRACE_VERSION, NO_PAGE, pool->total_pages);
+    return OK;
+}
+
+// Stop recording. Returns the bytes of trace left in the buffer, which is
+// the whole trace unless a flush callback took it along the way. Events
+// of calls still in flight are either recorded before or dropped.
+size_t buddy_trace_stop(struct buddy_pool *pool) {
+    struct buddy_trace *trace = &pool->trace;
+    if (!tracing(pool)) {
         return 0;
     }
 
-    if (rank > max_rank) {
+    // Another stop may have got there first
+    trace_lock(trace);
+    size_t used = trace->buf != NULL ? trace->used : 0;
+    if (trace->flush != NULL && used > 0) {
+        trace->flush(trace->buf, used, trace->arg);
+        used = 0;
+    }
+    __atomic_store_n(&trace->buf, NULL, __ATOMIC_RELAXED);
+    trace_unlock(trace);
+    return used;
+}
+
+// Start reading back the bytes of a trace, which must begin where a
+// recording did
+int buddy_trace_open(struct buddy_trace_reader *reader, const void *trace,
+                     size_t bytes) {
+    reader->pos = trace;
+    reader->end = reader->pos + bytes;
+    reader->last = 0;
+    if (bytes == 0 || (reader->pos[0] & 7) != TRACE_START) {
+        return -EINVAL;
+    }
+    return OK;
+}
+
+// Decode the next event. Returns 1 for an event, 0 at the end of the
+// trace and -EINVAL if it is cut short or was written by another version.
+// Helper function to read a 32-bit varint, or return -EINVAL if it is cut
+// short or too long
+static int read_varint(struct buddy_trace_reader *reader,
+                       unsigned int *bits) {
+    *bits = 0;
+    for (int shift = 0;; shift += 7) {
+        if (reader->pos == reader->end || shift > 28) return -EINVAL;
+        unsigned char byte = *reader->pos++;
+        *bits |= (unsigned int)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return OK;
+    }
+}
+
+int buddy_trace_next(struct buddy_trace_reader *reader,
+                     struct buddy_trace_event *event) {
+    if (reader->pos == reader->end) {
         return 0;
     }
 
-    int count = 0;
-    struct block_header *current = free_lists[rank];
-    while (current != NULL) {
-        count++;
-        current = current->next;
+    int tag = *reader->pos & 7;
+    int rank = *reader->pos++ >> 3;
+    unsigned int bits;
+    if (read_varint(reader, &bits) < 0) return -EINVAL;
+
+    event->rank = rank;
+    event->page = NO_PAGE;
+    event->result = 0;
+    event->align_rank = 0;
+    event->limit = 0;
+    switch (tag) {
+    case TRACE_START:
+        if (rank != TRACE_VERSION) return -EINVAL;
+        event->op = BUDDY_TRACE_START;
+        event->rank = 0;
+        event->page = unzigzag(bits);
+        reader->last = 0;
+        return 1;
+    case TRACE_ALLOC_FAIL:
+        event->op = BUDDY_TRACE_ALLOC;
+        return 1;
+    case TRACE_COUNT:
+        event->op = BUDDY_TRACE_COUNT;
+        event->result = unzigzag(bits);
+        return 1;
+    case TRACE_ALLOC:
+        event->op = BUDDY_TRACE_ALLOC;
+        break;
+    case TRACE_FREE:
+    case TRACE_FREE_FAIL:
+        event->op = BUDDY_TRACE_FREE;
+        event->rank = 0;
+        event->result = tag == TRACE_FREE ? OK : -EINVAL;
+        break;
+    case TRACE_RANK:
+        event->op = BUDDY_TRACE_RANK;
+        event->rank = 0;
+        event->result = rank == 0 ? -EINVAL : rank;
+        break;
+    case TRACE_CONSTRAINED: {
+        unsigned int limit;
+        if (read_varint(reader, &limit) < 0 || limit > INT_MAX) return -EINVAL;
+        event->op = BUDDY_TRACE_ALLOC_CONSTRAINED;
+        event->align_rank = bits >> 1;
+        event->limit = limit;
+        if (bits & 1) return 1;
+        if (read_varint(reader, &bits) < 0) return -EINVAL;
+        break;
+    }
+    default:
+        return -EINVAL;
     }
 
-    return count;
-}
\ No newline at end of file
+    // The rest carry a page delta
+    reader->last += unzigzag(bits);
+    event->page = reader->last;
+    return 1;
+}
+
+#if BUDDY_ADDR_ORDER
+// Helper function to check the bitmap tree of a rank against its free
+// list: one level-0 bit per listed block and none besides, and each bit
+// above set exactly when the word below it is non-zero
+static int verify_addr_bits(struct buddy_pool *pool, int rank, long count) {
+    for (int index = pool->free_lists[rank]; index != NO_PAGE;
+         index = pool->page_links[index].next) {
+        size_t bit = index >> (rank - 1);
+        if (!(pool->addr_bits[pool->addr_base[rank][0] + bit / 64] &
+              1ULL << (bit % 64))) {
+            return 0;
+        }
+    }
+
+    for (int level = 0; level < pool->addr_levels[rank]; level++) {
+        const unsigned long long *words =
+            &pool->addr_bits[pool->addr_base[rank][level]];
+        size_t nwords = level + 1 < pool->addr_levels[rank]
+                            ? pool->addr_base[rank][level + 1] -
+                                  pool->addr_base[rank][level]
+                            : 1;
+        long bits = 0;
+        for (size_t i = 0; i < nwords; i++) {
+            bits += __builtin_popcountll(words[i]);
+            if (level + 1 < pool->addr_levels[rank]) {
+                unsigned long long above =
+                    pool->addr_bits[pool->addr_base[rank][level + 1] + i / 64];
+                if (!(above >> (i % 64) & 1) != (words[i] == 0)) return 0;
+            }
+        }
+        if (level == 0 && bits != count) return 0;
+    }
+    return 1;
+}
+#endif
+
+// Helper function to check every invariant of a pool with all its locks
+// held. The descriptors are walked once, block by block, and each free
+// list once, so the cost is linear in the pages of the pool.
+static int verify_locked(struct buddy_pool *pool) {
+    long heads[MAX_RANK + 1] = {0};
+    long free_pages = 0;
+    int total = pool->total_pages;
+    // Lazy mode leaves buddies unmerged on purpose
+    int merged = !(pool->mode & BUDDY_MODE_LAZY) && pool->lazy_pending == 0;
+
+    // The blocks tile the pool: each head is aligned to its rank and
+    // fits, and interior pages carry no descriptor
+    for (int index = 0; index < total;) {
+        unsigned char meta = load_meta(pool, index);
+        int rank = meta & PAGE_RANK_MASK;
+        if (!(meta & PAGE_HEAD) || rank < 1 || rank > pool->max_rank) {
+            return -EINVAL;
+        }
+        int pages = rank_pages(rank);
+        if ((index & (pages - 1)) != 0 || pages > total - index ||
+            (meta & (PAGE_FREE | PAGE_CACHED)) == (PAGE_FREE | PAGE_CACHED)) {
+            return -EINVAL;
+        }
+        for (int i = 1; i < pages; i++) {
+            if (load_meta(pool, index + i) != 0) return -EINVAL;
+        }
+
+        if (meta & PAGE_FREE) {
+            heads[rank]++;
+            free_pages += pages;
+            // A free pair of buddies would have merged; the lower one of
+            // the pair is met first
+            int buddy = buddy_pfn(index, rank);
+            if (merged && rank < pool->max_rank && buddy > index &&
+                buddy < total && load_meta(pool, buddy) == meta) {
+                return -EINVAL;
+            }
+        }
+        index += pages;
+    }
+
+    // Every list holds exactly the free heads of its rank, properly
+    // linked, and matches its counter and mask bit. Counting against the
+    // descriptors also stops a corrupted list that loops.
+    for (int rank = 1; rank <= MAX_RANK; rank++) {
+        long count = 0;
+        int prev = NO_PAGE;
+        for (int index = pool->free_lists[rank]; index != NO_PAGE;
+             index = pool->page_links[index].next) {
+            if ((unsigned int)index >= (unsigned int)total ||
+                load_meta(pool, index) != (PAGE_HEAD | PAGE_FREE | rank) ||
+                pool->page_links[index].prev != prev || ++count > heads[rank]) {
+                return -EINVAL;
+            }
+            prev = index;
+        }
+        if (count != heads[rank] || count != pool->free_counts[rank] ||
+            !(pool->free_mask & 1u << rank) != (count == 0)) {
+            return -EINVAL;
+        }
+#if BUDDY_ADDR_ORDER
+        if (rank <= pool->max_rank && !verify_addr_bits(pool, rank, count)) {
+            return -EINVAL;
+        }
+#endif
+    }
+
+    return free_pages == pool->free_pages ? OK : -EINVAL;
+}
+
+// Check that the descriptors, free lists and counters of a pool agree.
+// Returns OK or -EINVAL. Takes every lock of the pool for one linear pass,
+// so it suits a watchdog calling it now and then; blocks moving in and out
+// of per-CPU caches meanwhile are fine.
+int buddy_verify(struct buddy_pool *pool) {
+    if (pool->memory_base == NULL) {
+        return OK;
+    }
+
+    pool_lock(pool);
+    for (int rank = 1; rank <= pool->max_rank; rank++) rank_lock(pool, rank);
+    int ret = verify_locked(pool);
+    unlock_ranks(pool, 1, pool->max_rank);
+    pool_unlock(pool);
+    return ret;
+}
+
+// Release the metadata and mapping owned by a pool. Region pools own
+// nothing outside their region and are left intact for a later
+// buddy_attach.
+void buddy_destroy(struct buddy_pool *pool) {
+    buddy_trace_stop(pool);
+    if (pool->region_magic != 0) {
+        return;
+    }
+    release_mapping(pool);
+    free(pool->page_meta);
+    free(pool->page_links);
+#if BUDDY_TAGS
+    free(pool->page_tags);
+#endif
+#if BUDDY_ADDR_ORDER
+    free(pool->addr_bits);
+#endif
+    memset(pool, 0, sizeof(*pool));
+}
+
+int init_page(void *p, int pgcount) {
+    default_pool = &own_pool;
+    return buddy_init(default_pool, p, pgcount);
+}
+
+void *init_page_mapped(int pgcount, unsigned int flags) {
+    default_pool = &own_pool;
+    return buddy_init_mapped(default_pool, pgcount, flags);
+}
+
+void *alloc_pages(int rank) {
+    return buddy_alloc(default_pool, rank);
+}
+
+void *alloc_pages_bytes(size_t size) {
+    return buddy_alloc_bytes(default_pool, size);
+}
+
+void *alloc_pages_tagged(int rank, int tag) {
+    return buddy_alloc_tagged(default_pool, rank, tag);
+}
+
+void *alloc_pages_constrained(int rank, int align_rank, void *max_addr) {
+    return buddy_alloc_constrained(default_pool, rank, align_rank, max_addr);
+}
+
+int set_tag_limit(int tag, long pages) {
+    return buddy_set_tag_limit(default_pool, tag, pages);
+}
+
+int query_tag_pages(long *out) {
+    return buddy_query_tags(default_pool, out);
+}
+
+struct buddy_pool *query_default_pool(void) {
+    return default_pool;
+}
+
+int return_pages(void *p) {
+    return buddy_free(default_pool, p);
+}
+
+int query_ranks(void *p) {
+    return buddy_query_rank(default_pool, p);
+}
+
+int query_page_counts(int rank) {
+    return buddy_query_count(default_pool, rank);
+}
+
+int query_ranks_bulk(void **pages, int n, int *out) {
+    return buddy_query_rank_bulk(default_pool, pages, n, out);
+}
+
+int query_page_counts_all(int out[BUDDY_MAX_RANK + 1]) {
+    return buddy_query_counts(default_pool, out);
+}
+
+int alloc_pages_bulk(int rank, int n, void **out) {
+    return buddy_alloc_bulk(default_pool, rank, n, out);
+}
+
+int return_pages_bulk(void **pages, int n) {
+    return buddy_free_bulk(default_pool, pages, n);
+}
+
+void drain_pages(void) {
+    buddy_drain(default_pool);
+}
+
+int set_pages_mode(unsigned int mode) {
+    return buddy_set_mode(default_pool, mode);
+}
+
+int coalesce_pages(void) {
+    return buddy_coalesce(default_pool);
+}
+
+int compact_pages(int rank, int budget, buddy_relocate_fn relocate, void *arg) {
+    return buddy_compact(default_pool, rank, budget, relocate, arg);
+}
+
+int set_pages_release_rank(int rank) {
+    return buddy_set_release_rank(default_pool, rank);
+}
+
+int set_pages_watermarks(long min, long low, long high, buddy_watermark_fn fn,
+                         void *arg) {
+    return buddy_set_watermarks(default_pool, min, low, high, fn, arg);
+}
+
+long query_free_pages(void) {
+    return buddy_free_pages(default_pool);
+}
+
+int query_largest_free_rank(void) {
+    return buddy_largest_free_rank(default_pool);
+}
+
+int query_frag_index(int rank) {
+    return buddy_frag_index(default_pool, rank);
+}
+
+int query_stats(struct buddy_stats *out) {
+    return buddy_get_stats(default_pool, out);
+}
+
+int trace_pages_start(void *buf, size_t size, buddy_trace_flush_fn flush,
+                      void *arg) {
+    return buddy_trace_start(default_pool, buf, size, flush, arg);
+}
+
+size_t trace_pages_stop(void) {
+    return buddy_trace_stop(default_pool);
+}
+
+int verify_pages(void) {
+    return buddy_verify(default_pool);
+}
+
+int format_pages(void *p, int pgcount) {
+    struct buddy_pool *pool = buddy_format(p, pgcount);
+    if (IS_ERR(pool)) return PTR_ERR(pool);
+    default_pool = pool;
+    return OK;
+}
+
+int attach_pages(void *p, int pgcount) {
+    struct buddy_pool *pool = buddy_attach(p, pgcount);
+    if (IS_ERR(pool)) return PTR_ERR(pool);
+    default_pool = pool;
+    return OK;
+}
@@ -2,9 +2,13 @@
 #define OS_MM_H
 #define MAX_ERRNO 4095
 
+#include <stddef.h>
+
 #define OK          0
+#define ENOMEM      12  /* Out of memory */
 #define EINVAL      22  /* Invalid argument */    
-#define ENOSPC      28  /* No page left */  
+#define ENOSPC      28  /* No page left */
+#define EDQUOT      122 /* Tag over its page limit */  
 
 
 #define IS_ERR_VALUE(x) ((x) >= (unsigned long)-MAX_ERRNO)
@@ -13,10 +17,377 @@ static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
 static inline long IS_ERR(const void *ptr) { return IS_ERR_VALUE((unsigned long)ptr); }
 
 
+// Compile-time geometry: -DBUDDY_MAX_RANK=<n> raises the rank ceiling (a
+// block of rank r is 2^(r-1) pages) and -DBUDDY_PAGE_SHIFT=<n> sets the
+// page size. Ranks are stored in five descriptor bits and the occupancy
+// mask is 32 bits wide, so the ceiling is 31.
+#ifndef BUDDY_MAX_RANK
+#define BUDDY_MAX_RANK 16
+#endif
+#ifndef BUDDY_PAGE_SHIFT
+#define BUDDY_PAGE_SHIFT 12
+#endif
+#define BUDDY_PAGE_SIZE (1UL << BUDDY_PAGE_SHIFT)
+
+_Static_assert(BUDDY_MAX_RANK >= 1 && BUDDY_MAX_RANK <= 31,
+               "BUDDY_MAX_RANK must be between 1 and 31");
+
+// Thread-safety mode, chosen at compile time with -DBUDDY_LOCKING=<n>
+#define BUDDY_LOCK_NONE 0    // Caller serializes all calls
+#define BUDDY_LOCK_GLOBAL 1  // One spinlock per pool around every call
+#define BUDDY_LOCK_RANK 2    // One spinlock per rank, short fast path
+#ifndef BUDDY_LOCKING
+#define BUDDY_LOCKING BUDDY_LOCK_NONE
+#endif
+
+// Spinlock padded to its own cache line
+struct buddy_lock {
+    int locked;
+} __attribute__((aligned(64)));
+
+// Per-CPU caches of low-rank blocks, enabled with -DBUDDY_PCP=1. Cached
+// blocks are allocated as far as query_page_counts is concerned; call
+// buddy_drain (drain_pages for the default pool) before an exact query.
+// An allocation that misses drains every cache before it fails.
+#ifndef BUDDY_PCP
+#define BUDDY_PCP 0
+#endif
+#ifndef BUDDY_PCP_SLOTS
+#define BUDDY_PCP_SLOTS 16    // Caches per pool, picked by CPU number
+#endif
+#ifndef BUDDY_PCP_MAX_RANK
+#define BUDDY_PCP_MAX_RANK 2  // Highest rank served from the caches
+#endif
+#ifndef BUDDY_PCP_HIGH
+#define BUDDY_PCP_HIGH 64     // Cached blocks per rank that trigger a drain
+#endif
+#ifndef BUDDY_PCP_BATCH
+#define BUDDY_PCP_BATCH 16    // Blocks moved per refill or drain
+#endif
+
+// Lock-free rank-1 stack, enabled with -DBUDDY_LOCKFREE=1. Freed single
+// pages are pushed with one CAS and popped by the next rank-1 allocation;
+// they rejoin the free lists, merging, once BUDDY_LF_HIGH have piled up,
+// when an allocation misses, or on buddy_drain. Like per-CPU caches,
+// parked pages look allocated to query_page_counts.
+#ifndef BUDDY_LOCKFREE
+#define BUDDY_LOCKFREE 0
+#endif
+#ifndef BUDDY_LF_HIGH
+#define BUDDY_LF_HIGH 256     // Parked pages that trigger a flush
+#endif
+
+#if BUDDY_LOCKFREE && BUDDY_PCP
+#error "BUDDY_LOCKFREE and BUDDY_PCP both cache rank-1 pages; pick one"
+#endif
+
+// Lowest-address-first allocation, enabled with -DBUDDY_ADDR_ORDER=1.
+// Each rank keeps a 64-ary bitmap tree over its free block heads, so the
+// lowest free block is found in a few word scans instead of taking
+// whichever block was freed last. Live blocks stay packed towards the
+// bottom of the pool and the top stays whole for large requests.
+#ifndef BUDDY_ADDR_ORDER
+#define BUDDY_ADDR_ORDER 0
+#endif
+#define BUDDY_ADDR_LEVELS 6  // 64^6 bits cover 2^31 pages
+
+// Runtime behaviour of a pool, set with buddy_set_mode
+#define BUDDY_MODE_LAZY 0x1    // Defer merging until an allocation misses
+#define BUDDY_MODE_STRICT 0x2  // Queries merge deferred blocks first
+#define BUDDY_MODE_DEBUG 0x4   // Frees also cross-check metadata and poison
+
+// Options for buddy_init_mapped, which maps the managed memory itself. The
+// base is aligned to a huge page, so blocks of 2MB and up (or 1GB and up)
+// sit on whole huge pages.
+#define BUDDY_MAP_HUGETLB 0x1   // hugetlbfs pages, else THP as a fallback
+#define BUDDY_MAP_THP 0x2       // madvise(MADV_HUGEPAGE) a normal mapping
+#define BUDDY_MAP_PREFAULT 0x4  // Fault every page in before returning
+#define BUDDY_MAP_ALIGN_1G 0x8  // Align to 1GB rather than 2MB
+#define BUDDY_MAP_NORESERVE 0x10  // Reserve no swap, for pools sized to
+                                  // their peak with buddy_set_release_rank
+
+// Allocation tags, enabled with -DBUDDY_TAGS=<n> for tags 0..n-1. Each
+// block remembers the tag it was allocated under, in a byte array beside
+// the descriptors, and the pool keeps the pages held per tag up to date,
+// so usage per tenant is known without walking the pool. Plain
+// allocations are tag 0.
+#ifndef BUDDY_TAGS
+#define BUDDY_TAGS 0
+#endif
+
+_Static_assert(BUDDY_TAGS >= 0 && BUDDY_TAGS <= 255,
+               "BUDDY_TAGS must be between 0 and 255");
+
+// Allocator counters, enabled with -DBUDDY_STATS=1. Counts describe the
+// free lists themselves, so blocks moved in and out of per-CPU caches are
+// counted once per refill or drain.
+#ifndef BUDDY_STATS
+#define BUDDY_STATS 0
+#endif
+
+struct buddy_stats {
+    unsigned long allocs[BUDDY_MAX_RANK + 1];  // Blocks handed out per rank
+    unsigned long frees[BUDDY_MAX_RANK + 1];   // Blocks given back per rank
+    unsigned long splits;               // Blocks halved by allocations
+    unsigned long merges;               // Buddy pairs coalesced by frees
+    unsigned long failures;             // -ENOSPC results
+    unsigned long fragmented_failures;  // ... while enough pages were free
+    unsigned long search_steps;         // Empty ranks skipped by the search
+    unsigned long pcp_hits;             // Allocations served by a cache
+    unsigned long pcp_refills;          // Batches moved into a cache
+    unsigned long pcp_drains;           // Batches moved out at the watermark
+    unsigned long compacted;            // Pages moved by buddy_compact
+    unsigned long released;             // Pages given back to the kernel
+};
+
+struct buddy_pcp {
+    struct buddy_lock lock;
+    int counts[BUDDY_PCP_MAX_RANK + 1];
+    // Page indices of cached block heads, hottest last
+    int blocks[BUDDY_PCP_MAX_RANK + 1][BUDDY_PCP_HIGH];
+};
+
+// Call tracing, started with buddy_trace_start. Every buddy_alloc,
+// buddy_free, buddy_query_rank and buddy_query_count call is appended with
+// its result to a caller-supplied buffer in a compact binary form, and the
+// reset of a pool by buddy_init is recorded too. Bulk calls are recorded
+// as one allocation or free per block, and buddy_alloc_constrained with
+// its alignment and address limit so that a replay can ask for the
+// same block. A full buffer is handed
+// to the flush callback and reused, so a file sink costs one write per
+// buffer; without a callback, later events are dropped and counted.
+typedef void (*buddy_trace_flush_fn)(const void *buf, size_t bytes,
+                                     void *arg);
+
+struct buddy_trace {
+    unsigned char *buf;     // NULL while not tracing
+    size_t size;
+    size_t used;
+    int last;               // Page number the next page delta is taken from
+    unsigned long dropped;  // Events lost to a full buffer
+    buddy_trace_flush_fn flush;
+    void *arg;
+#if BUDDY_LOCKING != BUDDY_LOCK_NONE
+    struct buddy_lock lock;
+#endif
+};
+
+// Decoded trace events, read back with buddy_trace_next
+#define BUDDY_TRACE_START 0  // Pool (re)initialized with page pages
+#define BUDDY_TRACE_ALLOC 1  // rank asked for, page allocated or -1
+#define BUDDY_TRACE_FREE 2   // page freed, result 0 or -EINVAL
+#define BUDDY_TRACE_RANK 3   // page queried, result its rank or -EINVAL
+#define BUDDY_TRACE_COUNT 4  // rank queried, result its free block count
+#define BUDDY_TRACE_ALLOC_CONSTRAINED 5  // rank, align_rank and limit asked
+                                         // for, page allocated or -1
+
+// Pages outside the pool, and addresses that are not page-aligned where a
+// block head is expected, are recorded as the pool size
+struct buddy_trace_event {
+    int op;
+    int rank;
+    int page;
+    int result;
+    // Constrained allocations only: the alignment rank, and the page of
+    // the pool that max_addr pointed at, or the pool size for no limit
+    int align_rank;
+    int limit;
+};
+
+struct buddy_trace_reader {
+    const unsigned char *pos;
+    const unsigned char *end;
+    int last;
+};
+
+// Doubly-linked free list node, indexed by page and valid on free heads
+struct page_link {
+    int prev;
+    int next;
+};
+
+// Low-memory callback for buddy_set_watermarks, called with the free page
+// count from the allocating or freeing thread with no pool locks held. It
+// may free pages to the pool but must not allocate from it. It may be
+// replaced or cleared while other threads use the pool; a call already
+// under way still completes with the old callback and argument.
+struct buddy_pool;
+typedef void (*buddy_watermark_fn)(struct buddy_pool *pool, long free_pages,
+                                   void *arg);
+
+// An independent buddy allocator instance. A zero-initialized pool is
+// valid and behaves as an empty pool until buddy_init is called.
+// buddy_format instead places the pool, its descriptors and its links at
+// the start of the region it manages, where buddy_attach finds them again.
+struct buddy_pool {
+    // Layout signature of a pool formatted into its region, otherwise 0
+    unsigned long region_magic;
+    // Size of that region in pages, metadata included
+    int region_pages;
+
+    // Mapping made by buddy_init_mapped, unmapped along with the pool
+    void *map_base;
+    size_t map_bytes;
+
+    void *memory_base;
+    int total_pages;
+    int max_rank;
+
+    // One descriptor byte per page, outside the managed memory
+    unsigned char *page_meta;
+    // Free list links, kept beside the descriptors rather than in free memory
+    struct page_link *page_links;
+#if BUDDY_TAGS
+    // Tag of each allocated block head
+    unsigned char *page_tags;
+#endif
+
+    // Free lists for each rank, holding the page index of the first block
+    int free_lists[BUDDY_MAX_RANK + 1];
+    // Number of blocks on each free list
+    int free_counts[BUDDY_MAX_RANK + 1];
+    // Bit r is set while free_lists[r] is non-empty
+    unsigned int free_mask;
+    // Pages on all free lists together
+    long free_pages;
+
+#if BUDDY_ADDR_ORDER
+    // Bitmap words of every rank. Level 0 of a rank has one bit per block
+    // of that rank, and each level above one bit per non-zero word below.
+    unsigned long long *addr_bits;
+    size_t addr_words;
+    int addr_base[BUDDY_MAX_RANK + 1][BUDDY_ADDR_LEVELS];
+    int addr_levels[BUDDY_MAX_RANK + 1];
+#endif
+
+    // BUDDY_MODE_* flags
+    unsigned int mode;
+    // Free blocks of this rank and above hold no memory, 0 to keep it all
+    int release_rank;
+    // Watermarks in free pages, set with buddy_set_watermarks. wmark_fired
+    // is set from a fall below low until the pool climbs back to high.
+    long wmark_min, wmark_low, wmark_high;
+    int wmark_fired;
+    buddy_watermark_fn wmark_fn;
+    void *wmark_arg;
+    // Frees left unmerged by lazy mode since the last coalescing pass
+    long lazy_pending;
+    // Page where the next buddy_compact call resumes
+    int compact_cursor;
+
+#if BUDDY_LOCKING == BUDDY_LOCK_GLOBAL
+    struct buddy_lock lock;
+#elif BUDDY_LOCKING == BUDDY_LOCK_RANK
+    // Guards free_lists[r], free_counts[r] and the links of blocks on them
+    struct buddy_lock rank_locks[BUDDY_MAX_RANK + 1];
+#endif
+
+#if BUDDY_PCP
+    struct buddy_pcp pcp[BUDDY_PCP_SLOTS];
+#endif
+
+#if BUDDY_LOCKFREE
+    // Top of the rank-1 stack plus one in the low half, 0 when empty, and
+    // a tag bumped by every update in the high half against ABA
+    unsigned long long lf_head __attribute__((aligned(64)));
+#endif
+
+#if BUDDY_STATS
+    struct buddy_stats stats;
+#endif
+
+#if BUDDY_TAGS
+    // Pages held under each tag, and the most each may hold, 0 for no limit
+    long tag_pages[BUDDY_TAGS];
+    long tag_limits[BUDDY_TAGS];
+#endif
+
+    struct buddy_trace trace;
+};
+
+// Relocation callback for buddy_compact. Moves the contents of the
+// allocated block at from to the fresh block at to, of the same rank, and
+// points its users at the new copy. Returns 0 once the block has moved, or
+// nonzero to leave it where it is. The callback runs without pool locks
+// held, and the block's owner must not free it meanwhile.
+typedef int (*buddy_relocate_fn)(void *from, void *to, int rank, void *arg);
+
+int buddy_init(struct buddy_pool *pool, void *p, int pgcount);
+void *buddy_init_mapped(struct buddy_pool *pool, int pgcount,
+                        unsigned int flags);
+void *buddy_alloc(struct buddy_pool *pool, int rank);
+void *buddy_alloc_bytes(struct buddy_pool *pool, size_t size);
+void *buddy_alloc_tagged(struct buddy_pool *pool, int rank, int tag);
+int buddy_set_tag_limit(struct buddy_pool *pool, int tag, long pages);
+int buddy_query_tags(struct buddy_pool *pool, long *out);
+int buddy_free(struct buddy_pool *pool, void *p);
+int buddy_alloc_bulk(struct buddy_pool *pool, int rank, int n, void **out);
+void *buddy_alloc_constrained(struct buddy_pool *pool, int rank,
+                              int align_rank, void *max_addr);
+int buddy_free_bulk(struct buddy_pool *pool, void **pages, int n);
+int buddy_query_rank(struct buddy_pool *pool, void *p);
+int buddy_query_count(struct buddy_pool *pool, int rank);
+int buddy_query_rank_bulk(struct buddy_pool *pool, void **pages, int n,
+                          int *out);
+int buddy_query_counts(struct buddy_pool *pool, int out[BUDDY_MAX_RANK + 1]);
+void buddy_drain(struct buddy_pool *pool);
+int buddy_set_mode(struct buddy_pool *pool, unsigned int mode);
+int buddy_coalesce(struct buddy_pool *pool);
+int buddy_set_release_rank(struct buddy_pool *pool, int rank);
+int buddy_set_watermarks(struct buddy_pool *pool, long min, long low,
+                         long high, buddy_watermark_fn fn, void *arg);
+long buddy_free_pages(struct buddy_pool *pool);
+int buddy_compact(struct buddy_pool *pool, int rank, int budget,
+                  buddy_relocate_fn relocate, void *arg);
+int buddy_largest_free_rank(struct buddy_pool *pool);
+int buddy_frag_index(struct buddy_pool *pool, int rank);
+int buddy_get_stats(struct buddy_pool *pool, struct buddy_stats *out);
+int buddy_verify(struct buddy_pool *pool);
+void buddy_destroy(struct buddy_pool *pool);
+struct buddy_pool *buddy_format(void *p, int pgcount);
+struct buddy_pool *buddy_attach(void *p, int pgcount);
+int buddy_region_pages(int pgcount);
+int buddy_trace_start(struct buddy_pool *pool, void *buf, size_t size,
+                      buddy_trace_flush_fn flush, void *arg);
+size_t buddy_trace_stop(struct buddy_pool *pool);
+int buddy_trace_open(struct buddy_trace_reader *reader, const void *trace,
+                     size_t bytes);
+int buddy_trace_next(struct buddy_trace_reader *reader,
+                     struct buddy_trace_event *event);
+
+// Wrappers around the default pool
 int init_page(void *p, int pgcount);
+void *init_page_mapped(int pgcount, unsigned int flags);
 void *alloc_pages(int rank);
+void *alloc_pages_bytes(size_t size);
+void *alloc_pages_tagged(int rank, int tag);
+int set_tag_limit(int tag, long pages);
+int query_tag_pages(long *out);
+struct buddy_pool *query_default_pool(void);
 int return_pages(void *p);
 int query_ranks(void *p);
 int query_page_counts(int rank);
+int query_ranks_bulk(void **pages, int n, int *out);
+int query_page_counts_all(int out[BUDDY_MAX_RANK + 1]);
+int alloc_pages_bulk(int rank, int n, void **out);
+void *alloc_pages_constrained(int rank, int align_rank, void *max_addr);
+int return_pages_bulk(void **pages, int n);
+void drain_pages(void);
+int set_pages_mode(unsigned int mode);
+int coalesce_pages(void);
+int set_pages_release_rank(int rank);
+int set_pages_watermarks(long min, long low, long high, buddy_watermark_fn fn,
+                         void *arg);
+long query_free_pages(void);
+int compact_pages(int rank, int budget, buddy_relocate_fn relocate, void *arg);
+int query_largest_free_rank(void);
+int query_frag_index(int rank);
+int query_stats(struct buddy_stats *out);
+int verify_pages(void);
+int format_pages(void *p, int pgcount);
+int attach_pages(void *p, int pgcount);
+int trace_pages_start(void *buf, size_t size, buddy_trace_flush_fn flush,
+                      void *arg);
+size_t trace_pages_stop(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,35 @@
+#ifndef OS_MM_INTERNAL_H
+#define OS_MM_INTERNAL_H
+
+#include <sched.h>
+
+#include "buddy.h"
+
+// Helpers shared by buddy.c and buddy_slab.c, kept out of the public
+// header so users of buddy.h get neither the names nor <sched.h>
+
+static inline void buddy_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Spin briefly, then yield so a preempted holder can run on busy hosts
+static inline void spin_lock(struct buddy_lock *lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        for (int spins = 0; __atomic_load_n(&lock->locked, __ATOMIC_RELAXED);
+             spins++) {
+            if (spins < 64) {
+                buddy_cpu_relax();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+}
+
+static inline void spin_unlock(struct buddy_lock *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif
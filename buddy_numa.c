@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include "buddy_numa.h"
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Memory policy for mbind, as in <numaif.h>, which needs libnuma
+#define NUMA_MPOL_BIND 2
+
+// Distances sysfs reports for the local node and for a remote one
+#define LOCAL_DISTANCE 10
+#define REMOTE_DISTANCE 20
+
+// Node ids sysfs may list, including those past BUDDY_NUMA_MAX_NODES
+#define NODE_IDS 1024
+
+// Front-end behind the numa_* wrappers
+static struct buddy_numa default_numa;
+
+// Helper function to read a sysfs id list like "0" or "0-3,8" into a
+// bitmap of max entries. Returns 0 if the file cannot be read.
+static int read_list(const char *path, unsigned char *set, int max) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+
+    int low, high, c;
+    while (fscanf(f, "%d", &low) == 1) {
+        high = low;
+        c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &high) != 1) break;
+            c = fgetc(f);
+        }
+        for (int id = low; id <= high && id < max; id++) {
+            if (id >= 0) set[id] = 1;
+        }
+        if (c != ',') break;
+    }
+    fclose(f);
+    return 1;
+}
+
+// Helper function to create a pool slot for every online node and map
+// each CPU to the pool of its node. Without sysfs everything is node 0.
+static void read_nodes(struct buddy_numa *numa) {
+    unsigned char online[BUDDY_NUMA_MAX_NODES] = {0};
+    if (!read_list("/sys/devices/system/node/online", online,
+                   BUDDY_NUMA_MAX_NODES)) {
+        online[0] = 1;
+    }
+
+    numa->nodes = 0;
+    memset(numa->pool_of_cpu, 0, sizeof(numa->pool_of_cpu));
+    for (int id = 0; id < BUDDY_NUMA_MAX_NODES; id++) {
+        if (!online[id]) continue;
+        int pool = numa->nodes++;
+        numa->node_ids[pool] = id;
+
+        char path[64];
+        unsigned char cpus[BUDDY_NUMA_MAX_CPUS] = {0};
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 id);
+        read_list(path, cpus, BUDDY_NUMA_MAX_CPUS);
+        for (int cpu = 0; cpu < BUDDY_NUMA_MAX_CPUS; cpu++) {
+            if (cpus[cpu]) numa->pool_of_cpu[cpu] = pool;
+        }
+    }
+    if (numa->nodes == 0) {
+        numa->node_ids[numa->nodes++] = 0;
+    }
+}
+
+// Helper function to find the pool serving a node id, or -1
+static int pool_of_node(struct buddy_numa *numa, int id) {
+    for (int i = 0; i < numa->nodes; i++) {
+        if (numa->node_ids[i] == id) return i;
+    }
+    return -1;
+}
+
+// Helper function to read the distances from the node of a pool to the
+// nodes of every pool. The sysfs row has a column per online node in
+// ascending id order, nodes without a pool included, so each column is
+// matched to its node id before it is stored.
+static void read_distances(struct buddy_numa *numa, int pool, int *dist) {
+    for (int i = 0; i < numa->nodes; i++) {
+        dist[i] = i == pool ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+    }
+
+    unsigned char online[NODE_IDS] = {0};
+    if (!read_list("/sys/devices/system/node/online", online, NODE_IDS)) {
+        return;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance",
+             numa->node_ids[pool]);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return;
+    for (int id = 0; id < NODE_IDS; id++) {
+        if (!online[id]) continue;
+        int distance;
+        if (fscanf(f, "%d", &distance) != 1) break;
+        int other = pool_of_node(numa, id);
+        if (other >= 0) dist[other] = distance;
+    }
+    fclose(f);
+}
+
+// Helper function to order the pools by distance from each pool. Ties
+// keep node id order, so equally remote nodes are tried lowest first.
+static void build_fallback(struct buddy_numa *numa) {
+    int dist[BUDDY_NUMA_MAX_NODES];
+    for (int pool = 0; pool < numa->nodes; pool++) {
+        read_distances(numa, pool, dist);
+        int *order = numa->order[pool];
+        for (int i = 0; i < numa->nodes; i++) {
+            int j = i;
+            while (j > 0 && dist[order[j - 1]] > dist[i]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+    }
+}
+
+// Helper function to bind a region to one node. If the kernel refuses,
+// the pages are placed on first touch instead, which for a pool serving
+// local threads is normally the same node.
+static void bind_region(void *addr, size_t len, int node) {
+#ifdef SYS_mbind
+    unsigned long mask[BUDDY_NUMA_MAX_NODES / (8 * sizeof(long)) + 1] = {0};
+    mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+    syscall(SYS_mbind, addr, len, NUMA_MPOL_BIND, mask,
+            8 * sizeof(mask) + 1, 0);
+#else
+    (void)addr;
+    (void)len;
+    (void)node;
+#endif
+}
+
+// Helper function to find the pool of the node the caller runs on
+static int this_pool(struct buddy_numa *numa) {
+    if (numa->nodes == 1) return 0;
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= BUDDY_NUMA_MAX_CPUS) return 0;
+    return numa->pool_of_cpu[cpu];
+}
+
+// Set up one pool of pgcount pages on every online node. numa must be
+// zeroed or destroyed.
+int buddy_numa_init(struct buddy_numa *numa, int pgcount) {
+    int region_pages = buddy_region_pages(pgcount);
+    if (region_pages < 0) {
+        return -EINVAL;
+    }
+
+    read_nodes(numa);
+    build_fallback(numa);
+    numa->region_bytes = (size_t)region_pages << BUDDY_PAGE_SHIFT;
+
+    for (int i = 0; i < numa->nodes; i++) {
+        void *region = mmap(NULL, numa->region_bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                            0);
+        if (region == MAP_FAILED) {
+            buddy_numa_destroy(numa);
+            return -ENOMEM;
+        }
+        numa->regions[i] = region;
+        // Bound before the metadata is first written, so it lands there
+        bind_region(region, numa->region_bytes, numa->node_ids[i]);
+
+        struct buddy_pool *pool = buddy_format(region, region_pages);
+        if (IS_ERR(pool)) {
+            buddy_numa_destroy(numa);
+            return PTR_ERR(pool);
+        }
+        numa->pools[i] = pool;
+    }
+
+    return OK;
+}
+
+// Allocate from the caller's node, then from the others nearest first
+void *buddy_numa_alloc(struct buddy_numa *numa, int rank) {
+    if (numa->nodes == 0) {
+        return ERR_PTR(-ENOSPC);
+    }
+
+    int *order = numa->order[this_pool(numa)];
+    void *p = ERR_PTR(-ENOSPC);
+    for (int i = 0; i < numa->nodes; i++) {
+        p = buddy_alloc(numa->pools[order[i]], rank);
+        if (!IS_ERR(p) || PTR_ERR(p) != -ENOSPC) break;
+    }
+    return p;
+}
+
+// Helper function to find the pool whose memory holds p, or -1
+static int owning_pool(struct buddy_numa *numa, void *p) {
+    for (int i = 0; i < numa->nodes; i++) {
+        if ((uintptr_t)p - (uintptr_t)numa->regions[i] < numa->region_bytes) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Return pages to the pool of the node they came from
+int buddy_numa_free(struct buddy_numa *numa, void *p) {
+    int pool = owning_pool(numa, p);
+    if (pool < 0) {
+        return -EINVAL;
+    }
+
+    return buddy_free(numa->pools[pool], p);
+}
+
+// Query the node id whose pool holds p
+int buddy_numa_node_of(struct buddy_numa *numa, void *p) {
+    int pool = owning_pool(numa, p);
+    return pool < 0 ? -EINVAL : numa->node_ids[pool];
+}
+
+// Query how many unallocated blocks of a rank remain over all nodes
+int buddy_numa_query_count(struct buddy_numa *numa, int rank) {
+    int total = 0;
+    for (int i = 0; i < numa->nodes; i++) {
+        int count = buddy_query_count(numa->pools[i], rank);
+        if (count < 0) return count;
+        total += count;
+    }
+    return total;
+}
+
+// Release every pool and its mapping. A pool owns nothing outside its
+// region, so it goes with the unmapping.
+void buddy_numa_destroy(struct buddy_numa *numa) {
+    for (int i = 0; i < numa->nodes; i++) {
+        if (numa->pools[i] != NULL) buddy_destroy(numa->pools[i]);
+        if (numa->regions[i] != NULL) {
+            munmap(numa->regions[i], numa->region_bytes);
+        }
+    }
+    memset(numa, 0, sizeof(*numa));
+}
+
+int numa_init_pages(int pgcount) {
+    buddy_numa_destroy(&default_numa);
+    return buddy_numa_init(&default_numa, pgcount);
+}
+
+void *numa_alloc_pages(int rank) {
+    return buddy_numa_alloc(&default_numa, rank);
+}
+
+int numa_return_pages(void *p) {
+    return buddy_numa_free(&default_numa, p);
+}
+
+int numa_query_page_counts(int rank) {
+    return buddy_numa_query_count(&default_numa, rank);
+}
@@ -0,0 +1,47 @@
+#ifndef OS_MM_NUMA_H
+#define OS_MM_NUMA_H
+
+#include <stddef.h>
+
+#include "buddy.h"
+
+// NUMA front-end. One buddy pool per memory node, each formatted into its
+// own mapping bound to that node, so the pool's descriptors and links sit
+// on the node they describe. Allocations go to the pool of the calling
+// thread's node and fall back to the other nodes nearest first.
+
+#ifndef BUDDY_NUMA_MAX_NODES
+#define BUDDY_NUMA_MAX_NODES 16
+#endif
+#ifndef BUDDY_NUMA_MAX_CPUS
+#define BUDDY_NUMA_MAX_CPUS 1024
+#endif
+
+struct buddy_numa {
+    int nodes;
+    // Node id served by each pool, and the pool serving each CPU
+    int node_ids[BUDDY_NUMA_MAX_NODES];
+    unsigned char pool_of_cpu[BUDDY_NUMA_MAX_CPUS];
+    // Pools in fallback order for each pool, itself first
+    int order[BUDDY_NUMA_MAX_NODES][BUDDY_NUMA_MAX_NODES];
+
+    // Each pool lives at the start of its region
+    struct buddy_pool *pools[BUDDY_NUMA_MAX_NODES];
+    void *regions[BUDDY_NUMA_MAX_NODES];
+    size_t region_bytes;
+};
+
+int buddy_numa_init(struct buddy_numa *numa, int pgcount);
+void *buddy_numa_alloc(struct buddy_numa *numa, int rank);
+int buddy_numa_free(struct buddy_numa *numa, void *p);
+int buddy_numa_node_of(struct buddy_numa *numa, void *p);
+int buddy_numa_query_count(struct buddy_numa *numa, int rank);
+void buddy_numa_destroy(struct buddy_numa *numa);
+
+// Wrappers around the default NUMA front-end
+int numa_init_pages(int pgcount);
+void *numa_alloc_pages(int rank);
+int numa_return_pages(void *p);
+int numa_query_page_counts(int rank);
+
+#endif
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include "buddy_slab.h"
+#include "buddy_internal.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Marks the end of a partial list and of a slab's free objects
+#define NO_PAGE (-1)
+#define NO_OBJECT (-1)
+
+// The cache lock covers its partial list and the descriptors of its slabs
+#if BUDDY_LOCKING == BUDDY_LOCK_NONE
+#define cache_lock(cache) ((void)(cache))
+#define cache_unlock(cache) ((void)(cache))
+#else
+#define cache_lock(cache) spin_lock(&(cache)->lock)
+#define cache_unlock(cache) spin_unlock(&(cache)->lock)
+#endif
+
+// Caches behind the init_bytes/alloc_bytes/free_bytes wrappers
+static struct buddy_slabs default_slabs;
+
+// Helper function to pick the size class of 1..BUDDY_SLAB_MAX bytes
+static int size_class(size_t size) {
+    if (size <= BUDDY_SLAB_MIN) return 0;
+    return 8 * sizeof(long) - __builtin_clzl(size - 1) -
+           __builtin_ctz(BUDDY_SLAB_MIN);
+}
+
+// Helper function to get the address of a page of the pool
+static char *slab_page(struct buddy_slabs *slabs, int index) {
+    return (char *)slabs->pool->memory_base +
+           ((size_t)index << BUDDY_PAGE_SHIFT);
+}
+
+static void push_partial(struct buddy_slabs *slabs, struct buddy_cache *cache,
+                         int index) {
+    struct buddy_slab *slab = &slabs->pages[index];
+    slab->prev = NO_PAGE;
+    slab->next = cache->partial;
+    if (cache->partial != NO_PAGE) slabs->pages[cache->partial].prev = index;
+    cache->partial = index;
+}
+
+static void unlink_partial(struct buddy_slabs *slabs,
+                           struct buddy_cache *cache, int index) {
+    struct buddy_slab *slab = &slabs->pages[index];
+    if (slab->prev != NO_PAGE) {
+        slabs->pages[slab->prev].next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next != NO_PAGE) slabs->pages[slab->next].prev = slab->prev;
+}
+
+// Helper function to turn a fresh page into an empty slab of a cache.
+// Free objects are threaded through their first bytes in address order.
+static int grow(struct buddy_slabs *slabs, struct buddy_cache *cache) {
+    char *page = buddy_alloc(slabs->pool, 1);
+    if (IS_ERR(page)) {
+        return NO_PAGE;
+    }
+
+    int index = (page - (char *)slabs->pool->memory_base) >> BUDDY_PAGE_SHIFT;
+    struct buddy_slab *slab = &slabs->pages[index];
+    for (int i = 0; i < cache->per_slab; i++) {
+        *(int *)(page + i * cache->size) =
+            i + 1 < cache->per_slab ? (int)((i + 1) * cache->size) : NO_OBJECT;
+    }
+    slab->free = 0;
+    slab->inuse = 0;
+    __atomic_store_n(&slab->cache, cache, __ATOMIC_RELEASE);
+    push_partial(slabs, cache, index);
+    cache->empty++;
+    return index;
+}
+
+// Set up the size classes over a pool. Must be redone after the pool is
+// initialized again.
+int buddy_slab_init(struct buddy_slabs *slabs, struct buddy_pool *pool) {
+    if (pool->memory_base == NULL) {
+        return -EINVAL;
+    }
+
+    struct buddy_slab *pages = calloc(pool->total_pages, sizeof(*pages));
+    if (pages == NULL) {
+        return -ENOMEM;
+    }
+
+    memset(slabs, 0, sizeof(*slabs));
+    slabs->pool = pool;
+    slabs->pages = pages;
+    slabs->npages = pool->total_pages;
+    for (int c = 0; c < BUDDY_SLAB_CLASSES; c++) {
+        struct buddy_cache *cache = &slabs->caches[c];
+        cache->size = (size_t)BUDDY_SLAB_MIN << c;
+        // A class that fits only once per page is no better than a page
+        cache->per_slab =
+            cache->size <= BUDDY_PAGE_SIZE / 2 ? BUDDY_PAGE_SIZE / cache->size
+                                               : 0;
+        cache->partial = NO_PAGE;
+    }
+    return OK;
+}
+
+// Allocate size bytes: an object of the smallest class that holds it, or
+// the smallest block of pages beyond BUDDY_SLAB_MAX
+void *buddy_slab_alloc(struct buddy_slabs *slabs, size_t size) {
+    if (size == 0 || slabs->pages == NULL) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    if (size > BUDDY_SLAB_MAX) {
+        return buddy_alloc_bytes(slabs->pool, size);
+    }
+    struct buddy_cache *cache = &slabs->caches[size_class(size)];
+    if (cache->per_slab == 0) {
+        return buddy_alloc_bytes(slabs->pool, size);
+    }
+
+    cache_lock(cache);
+    int index = cache->partial;
+    if (index == NO_PAGE) {
+        index = grow(slabs, cache);
+        if (index == NO_PAGE) {
+            cache_unlock(cache);
+            return ERR_PTR(-ENOSPC);
+        }
+    }
+
+    struct buddy_slab *slab = &slabs->pages[index];
+    char *object = slab_page(slabs, index) + slab->free;
+    slab->free = *(int *)object;
+    if (slab->inuse++ == 0) cache->empty--;
+    if (slab->inuse == cache->per_slab) unlink_partial(slabs, cache, index);
+
+    cache_unlock(cache);
+    return object;
+}
+
+// Free an object or block from buddy_slab_alloc. A cache keeps one empty
+// slab and returns any further empty page to the pool. Misaligned objects
+// are refused, but a repeated free is only caught once its slab is empty.
+int buddy_slab_free(struct buddy_slabs *slabs, void *p) {
+    if (slabs->pages == NULL) {
+        return -EINVAL;
+    }
+
+    size_t offset = (uintptr_t)p - (uintptr_t)slabs->pool->memory_base;
+    size_t index = offset >> BUDDY_PAGE_SHIFT;
+    if (index >= (size_t)slabs->npages) {
+        return -EINVAL;
+    }
+
+    struct buddy_slab *slab = &slabs->pages[index];
+    struct buddy_cache *cache = __atomic_load_n(&slab->cache, __ATOMIC_ACQUIRE);
+    if (cache == NULL) {
+        return buddy_free(slabs->pool, p);
+    }
+
+    int in_page = offset & (BUDDY_PAGE_SIZE - 1);
+    if (in_page % cache->size != 0) {
+        return -EINVAL;
+    }
+
+    cache_lock(cache);
+    if (slab->inuse == 0) {
+        cache_unlock(cache);
+        return -EINVAL;
+    }
+    *(int *)p = slab->free;
+    slab->free = in_page;
+    if (slab->inuse-- == cache->per_slab) push_partial(slabs, cache, index);
+
+    if (slab->inuse == 0) {
+        if (cache->empty == 0) {
+            cache->empty++;
+        } else {
+            unlink_partial(slabs, cache, index);
+            __atomic_store_n(&slab->cache, NULL, __ATOMIC_RELAXED);
+            cache_unlock(cache);
+            return buddy_free(slabs->pool, slab_page(slabs, index));
+        }
+    }
+
+    cache_unlock(cache);
+    return OK;
+}
+
+// Return every slab page to the pool and drop the side table
+void buddy_slab_destroy(struct buddy_slabs *slabs) {
+    for (int i = 0; i < slabs->npages; i++) {
+        if (slabs->pages[i].cache != NULL) {
+            buddy_free(slabs->pool, slab_page(slabs, i));
+        }
+    }
+    free(slabs->pages);
+    memset(slabs, 0, sizeof(*slabs));
+}
+
+// init_page hands out every page again, so the old slabs are dropped
+// rather than freed
+int init_bytes(void) {
+    free(default_slabs.pages);
+    default_slabs.pages = NULL;
+    return buddy_slab_init(&default_slabs, query_default_pool());
+}
+
+void *alloc_bytes(size_t size) {
+    return buddy_slab_alloc(&default_slabs, size);
+}
+
+int free_bytes(void *p) {
+    return buddy_slab_free(&default_slabs, p);
+}
@@ -0,0 +1,56 @@
+#ifndef OS_MM_SLAB_H
+#define OS_MM_SLAB_H
+
+#include <stddef.h>
+
+#include "buddy.h"
+
+// Object caches for sub-page sizes. Power-of-two size classes from
+// BUDDY_SLAB_MIN to BUDDY_SLAB_MAX bytes are carved out of single pages of
+// a buddy pool; larger requests go to the pool as whole blocks. Slab
+// descriptors live in a side table indexed by page, like the pool's own
+// metadata, so objects carry no header and are aligned to their size.
+
+#define BUDDY_SLAB_MIN 32
+#define BUDDY_SLAB_MAX 2048
+#define BUDDY_SLAB_CLASSES 7  // 32, 64, ..., 2048
+
+// Per-page slab descriptor
+struct buddy_slab {
+    struct buddy_cache *cache;  // NULL unless the page is a slab
+    int prev, next;             // Partial list links, by page index
+    int free;                   // Offset of the first free object, or -1
+    int inuse;
+};
+
+// One size class
+struct buddy_cache {
+    size_t size;
+    int per_slab;
+    // Slabs with a free object, by page index, and how many are empty
+    int partial;
+    int empty;
+#if BUDDY_LOCKING != BUDDY_LOCK_NONE
+    struct buddy_lock lock;
+#endif
+};
+
+struct buddy_slabs {
+    struct buddy_pool *pool;
+    // One descriptor per page of the pool
+    struct buddy_slab *pages;
+    int npages;
+    struct buddy_cache caches[BUDDY_SLAB_CLASSES];
+};
+
+int buddy_slab_init(struct buddy_slabs *slabs, struct buddy_pool *pool);
+void *buddy_slab_alloc(struct buddy_slabs *slabs, size_t size);
+int buddy_slab_free(struct buddy_slabs *slabs, void *p);
+void buddy_slab_destroy(struct buddy_slabs *slabs);
+
+// Wrappers over the default pool. Call init_bytes after init_page.
+int init_bytes(void);
+void *alloc_bytes(size_t size);
+int free_bytes(void *p);
+
+#endif
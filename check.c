@@ -0,0 +1,905 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "buddy_numa.h"
+#include "buddy_slab.h"
+
+// Feature checks, kept apart from main.c whose output is fixed. Built
+// once per locking mode and option set by make check; each case runs on
+// a fresh default pool and reports the checks that fail.
+
+#define PAGES (8192)
+#define SLOTS (1024)
+#define WATCH_CHECKS (300)
+
+static void *memory;
+static int failed;
+
+#define CHECK(cond)                                                 \
+    do {                                                            \
+        if (!(cond)) {                                              \
+            printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond);     \
+            failed++;                                               \
+        }                                                           \
+    } while (0)
+
+static unsigned int next_random(unsigned int *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+// Allocate and free at random over slots, leaving the pool fragmented
+static void churn(void **slots, int nslots, unsigned int seed, int ops) {
+    for (int op = 0; op < ops; op++) {
+        int i = next_random(&seed) % nslots;
+        if (slots[i] != NULL) {
+            CHECK(return_pages(slots[i]) == OK);
+            slots[i] = NULL;
+        } else {
+            void *p = alloc_pages(next_random(&seed) % 4 + 1);
+            if (!IS_ERR(p)) slots[i] = p;
+        }
+    }
+}
+
+static void release_all(void **slots, int nslots) {
+    for (int i = 0; i < nslots; i++) {
+        if (slots[i] != NULL) return_pages(slots[i]);
+        slots[i] = NULL;
+    }
+}
+
+static void check_verify(void) {
+    static void *slots[SLOTS];
+    struct buddy_pool *pool = query_default_pool();
+
+    CHECK(verify_pages() == OK);
+    churn(slots, SLOTS, 1, 20000);
+    CHECK(verify_pages() == OK);
+
+    // A counter off by one is caught, and forgiven once put back
+    pool->free_pages++;
+    CHECK(verify_pages() == -EINVAL);
+    pool->free_pages--;
+    pool->free_counts[1]++;
+    CHECK(verify_pages() == -EINVAL);
+    pool->free_counts[1]--;
+    CHECK(verify_pages() == OK);
+
+    release_all(slots, SLOTS);
+    drain_pages();
+    CHECK(verify_pages() == OK);
+    CHECK(query_free_pages() == PAGES);
+}
+
+// Relocation callback that moves a page along with its owner's slot. Each
+// page holds the number of its slot, which must survive the move.
+static void *compact_slots[PAGES];
+
+static int move_page(void *from, void *to, int rank, void *arg) {
+    int *moves = arg;
+    int slot = *(int *)from;
+    CHECK(rank == 1 && compact_slots[slot] == from);
+    memcpy(to, from, BUDDY_PAGE_SIZE);
+    compact_slots[slot] = to;
+    (*moves)++;
+    return 0;
+}
+
+static int refuse_move(void *from, void *to, int rank, void *arg) {
+    (void)from;
+    (void)to;
+    (void)rank;
+    (void)arg;
+    return 1;
+}
+
+// With every other page taken nothing above rank 1 is free, until
+// compaction packs the pages together
+static void check_compact(void) {
+    int moves = 0;
+    for (int i = 0; i < PAGES; i++) {
+        compact_slots[i] = alloc_pages(1);
+        *(int *)compact_slots[i] = i;
+    }
+    for (int i = 0; i < PAGES; i += 2) {
+        CHECK(return_pages(compact_slots[i]) == OK);
+        compact_slots[i] = NULL;
+    }
+    drain_pages();
+    CHECK(query_largest_free_rank() == 1);
+    CHECK(query_frag_index(4) > 500);
+
+    CHECK(compact_pages(4, 16, refuse_move, NULL) == 0);
+    CHECK(query_largest_free_rank() == 1);
+    CHECK(compact_pages(0, 16, move_page, &moves) == -EINVAL);
+
+    int moved = compact_pages(4, 16, move_page, &moves);
+    CHECK(moved > 0 && moved <= 16 && moved == moves);
+    CHECK(query_largest_free_rank() >= 4);
+    CHECK(verify_pages() == OK);
+
+    void *block = alloc_pages(4);
+    CHECK(!IS_ERR(block));
+    for (int i = 1; i < PAGES; i += 2) {
+        CHECK(*(int *)compact_slots[i] == i);
+        CHECK(return_pages(compact_slots[i]) == OK);
+    }
+    CHECK(return_pages(block) == OK);
+    drain_pages();
+    CHECK(query_free_pages() == PAGES);
+}
+
+// Lazy mode leaves buddies apart until asked; strict queries and leaving
+// the mode merge them. Rank 3 stays clear of the per-CPU caches.
+static void check_modes(void) {
+    CHECK(set_pages_mode(BUDDY_MODE_LAZY) == OK);
+    void *a = alloc_pages(3), *b = alloc_pages(3);
+    CHECK(return_pages(a) == OK && return_pages(b) == OK);
+    CHECK(query_page_counts(3) == 2);
+    CHECK(verify_pages() == OK);
+    CHECK(coalesce_pages() > 0);
+    CHECK(query_page_counts(3) == 0);
+    CHECK(query_page_counts(14) == 1);
+
+    a = alloc_pages(3);
+    b = alloc_pages(3);
+    CHECK(return_pages(a) == OK && return_pages(b) == OK);
+    CHECK(set_pages_mode(BUDDY_MODE_LAZY | BUDDY_MODE_STRICT) == OK);
+    CHECK(query_page_counts(3) == 0);
+    a = alloc_pages(3);
+    CHECK(return_pages(a) == OK);
+    CHECK(set_pages_mode(0) == OK);
+    CHECK(query_page_counts(14) == 1);
+
+    CHECK(verify_pages() == OK);
+}
+
+// Debug mode refuses what does not match the metadata
+static void check_debug(void) {
+    CHECK(set_pages_mode(BUDDY_MODE_DEBUG) == OK);
+    void *a = alloc_pages(3);
+    CHECK(return_pages((char *)a + BUDDY_PAGE_SIZE) == -EINVAL);
+    CHECK(return_pages(a) == OK);
+    CHECK(return_pages(a) == -EINVAL);
+    CHECK(return_pages_bulk(&a, 1) == 0);
+    CHECK(set_pages_mode(0) == OK);
+    CHECK(verify_pages() == OK);
+    CHECK(query_free_pages() == PAGES);
+}
+
+static void check_bulk(void) {
+    static void *pages[PAGES];
+    static int ranks[PAGES];
+    int counts[BUDDY_MAX_RANK + 1];
+
+    CHECK(alloc_pages_bulk(0, 1, pages) == -EINVAL);
+    CHECK(alloc_pages_bulk(1, 0, pages) == 0);
+    CHECK(alloc_pages_bulk(1, 1000, pages) == 1000);
+    CHECK(query_ranks_bulk(pages, 1000, ranks) == 1000);
+    int ones = 0;
+    for (int i = 0; i < 1000; i++) ones += ranks[i] == 1;
+    CHECK(ones == 1000);
+    CHECK(verify_pages() == OK);
+    CHECK(return_pages_bulk(pages, 1000) == 1000);
+
+    // A request larger than the pool gets what there is
+    drain_pages();
+    CHECK(alloc_pages_bulk(13, 3, pages) == 2);
+    CHECK(return_pages_bulk(pages, 2) == 2);
+    CHECK(query_page_counts_all(counts) == OK);
+    CHECK(counts[14] == 1 && counts[13] == 0);
+
+    // So does one that the min watermark cuts off, and out is filled with
+    // live blocks only as far as the count returned
+    CHECK(set_pages_watermarks(PAGES / 2, PAGES / 2, PAGES / 2, NULL,
+                               NULL) == OK);
+    for (int i = 0; i < PAGES; i++) pages[i] = NULL;
+    int got = alloc_pages_bulk(1, PAGES, pages);
+    CHECK(got > 0 && got < PAGES);
+    CHECK(query_free_pages() >= PAGES / 2);
+    CHECK(query_ranks_bulk(pages, got, ranks) == got);
+    for (int i = 0; i < got; i++) CHECK(ranks[i] == 1);
+    for (int i = got; i < PAGES; i++) CHECK(pages[i] == NULL);
+    CHECK(return_pages_bulk(pages, got) == got);
+    CHECK(set_pages_watermarks(0, 0, 0, NULL, NULL) == OK);
+    drain_pages();
+    CHECK(query_free_pages() == PAGES);
+}
+
+static int low_calls;
+
+static void on_low(struct buddy_pool *pool, long free_pages, void *arg) {
+    (void)pool;
+    (void)arg;
+    CHECK(free_pages < PAGES / 2);
+    low_calls++;
+}
+
+// Allocations stop at the min watermark and the low one calls back
+static void check_watermarks(void) {
+    static void *pages[PAGES];
+    int n = 0;
+
+    CHECK(set_pages_watermarks(PAGES / 2, PAGES / 4, PAGES, on_low, NULL) ==
+          -EINVAL);
+    CHECK(set_pages_watermarks(PAGES / 4, PAGES / 2, PAGES * 3 / 4, on_low,
+                               NULL) == OK);
+    low_calls = 0;
+    while (n < PAGES && !IS_ERR(pages[n] = alloc_pages(1))) n++;
+    CHECK(n < PAGES);
+    CHECK(query_free_pages() >= PAGES / 4);
+    CHECK(low_calls >= 1);
+
+    for (int i = 0; i < n; i++) CHECK(return_pages(pages[i]) == OK);
+    drain_pages();
+    CHECK(query_free_pages() == PAGES);
+    CHECK(set_pages_watermarks(0, 0, 0, NULL, NULL) == OK);
+    CHECK(verify_pages() == OK);
+}
+
+// Releasing free memory above a rank leaves the allocator's view alone,
+// but the kernel takes the pages back and hands out zeroed ones next time
+static void check_release(void) {
+    size_t bytes = (size_t)BUDDY_PAGE_SIZE << 4;
+    unsigned char resident[16];
+    CHECK(set_pages_release_rank(-1) == -EINVAL);
+    CHECK(set_pages_release_rank(4) == OK);
+    void *p = alloc_pages(5);
+    CHECK(!IS_ERR(p));
+    memset(p, 1, bytes);
+    CHECK(mincore(p, bytes, resident) == 0 && resident[0] & 1);
+    CHECK(return_pages(p) == OK);
+    CHECK(verify_pages() == OK);
+    CHECK(query_page_counts(14) == 1);
+
+    int kept = 0;
+    CHECK(mincore(p, bytes, resident) == 0);
+    for (size_t i = 0; i < bytes / sysconf(_SC_PAGESIZE); i++) {
+        kept += resident[i] & 1;
+    }
+    CHECK(kept == 0);
+
+    // A split keeps the lower half, so the same block comes back
+    unsigned char *q = alloc_pages(5);
+    CHECK(q == p);
+    size_t dirty = 0;
+    for (size_t i = 0; i < bytes; i++) dirty += q[i] != 0;
+    CHECK(dirty == 0);
+    CHECK(return_pages(q) == OK);
+    CHECK(set_pages_release_rank(0) == OK);
+}
+
+#if BUDDY_TAGS
+// Pages are charged to the tag they were allocated under, up to its limit
+static void check_tags(void) {
+    long held[BUDDY_TAGS];
+
+    CHECK(alloc_pages_tagged(1, BUDDY_TAGS) == ERR_PTR(-EINVAL));
+    CHECK(set_tag_limit(1, 8) == OK);
+    void *a = alloc_pages_tagged(3, 1), *b = alloc_pages_tagged(3, 1);
+    CHECK(!IS_ERR(a) && !IS_ERR(b));
+    CHECK(alloc_pages_tagged(1, 1) == ERR_PTR(-EDQUOT));
+    void *c = alloc_pages(2);
+    CHECK(query_tag_pages(held) == OK);
+    CHECK(held[0] == 2 && held[1] == 8);
+
+    CHECK(return_pages(a) == OK);
+    CHECK(query_tag_pages(held) == OK);
+    CHECK(held[1] == 4);
+    CHECK(!IS_ERR(a = alloc_pages_tagged(3, 1)));
+    CHECK(return_pages(a) == OK && return_pages(b) == OK);
+    CHECK(return_pages(c) == OK);
+    CHECK(query_tag_pages(held) == OK);
+    CHECK(held[0] == 0 && held[1] == 0);
+    CHECK(set_tag_limit(1, 0) == OK);
+}
+#endif
+
+// Size classes end at 2KB, objects of a class are aligned to it and
+// reused last in first out, and a cache keeps only one empty slab
+static void check_slab(void) {
+    struct buddy_slabs slabs;
+    struct buddy_pool *pool = query_default_pool();
+    CHECK(buddy_slab_init(&slabs, pool) == OK);
+    CHECK(buddy_slab_alloc(&slabs, 0) == ERR_PTR(-EINVAL));
+
+    // Both ends of the smallest and largest class share a page with an
+    // object of the same class; one byte more is a page of its own
+    char *small = buddy_slab_alloc(&slabs, 1);
+    char *small2 = buddy_slab_alloc(&slabs, 32);
+    char *large = buddy_slab_alloc(&slabs, 2048);
+    char *large2 = buddy_slab_alloc(&slabs, 1025);
+    char *page = buddy_slab_alloc(&slabs, 2049);
+    CHECK(!IS_ERR(small) && !IS_ERR(small2) && !IS_ERR(large) &&
+          !IS_ERR(large2) && !IS_ERR(page));
+    CHECK((uintptr_t)small % 32 == 0 && (uintptr_t)large % 2048 == 0);
+    CHECK((uintptr_t)small / BUDDY_PAGE_SIZE ==
+              (uintptr_t)small2 / BUDDY_PAGE_SIZE &&
+          small != small2);
+    CHECK((uintptr_t)large / BUDDY_PAGE_SIZE ==
+              (uintptr_t)large2 / BUDDY_PAGE_SIZE &&
+          large != large2);
+    CHECK((uintptr_t)page % BUDDY_PAGE_SIZE == 0 && query_ranks(page) == 1);
+
+    // The object freed last is handed out first
+    CHECK(buddy_slab_free(&slabs, small2) == OK);
+    CHECK(buddy_slab_alloc(&slabs, 20) == small2);
+
+    // Misaligned, foreign and repeated frees are refused. A repeat is
+    // caught once the object's slab is empty.
+    CHECK(buddy_slab_free(&slabs, small + 8) == -EINVAL);
+    CHECK(buddy_slab_free(&slabs, &slabs) == -EINVAL);
+    CHECK(buddy_slab_free(&slabs, page + 64) == -EINVAL);
+    CHECK(buddy_slab_free(&slabs, page) == OK);
+    CHECK(buddy_slab_free(&slabs, page) == -EINVAL);
+    CHECK(buddy_slab_free(&slabs, small) == OK);
+    CHECK(buddy_slab_free(&slabs, small2) == OK);
+    CHECK(buddy_slab_free(&slabs, small2) == -EINVAL);
+    CHECK(buddy_slab_free(&slabs, large) == OK);
+    CHECK(buddy_slab_free(&slabs, large2) == OK);
+
+    // Of three slabs emptied, two go back to the pool
+    static char *objects[6];
+    drain_pages();
+    long before = query_free_pages();
+    for (int i = 0; i < 6; i++) objects[i] = buddy_slab_alloc(&slabs, 2048);
+    drain_pages();
+    CHECK(query_free_pages() == before - 2);
+    for (int i = 0; i < 6; i++) {
+        CHECK(buddy_slab_free(&slabs, objects[i]) == OK);
+    }
+    drain_pages();
+    CHECK(query_free_pages() == before);
+
+    buddy_slab_destroy(&slabs);
+    drain_pages();
+    CHECK(query_free_pages() == PAGES);
+    CHECK(verify_pages() == OK);
+}
+
+// Helper function to ask the kernel which node holds a page, or -1
+static int node_of_page(void *p) {
+    int status = -1;
+#ifdef SYS_move_pages
+    if (syscall(SYS_move_pages, 0, 1UL, &p, NULL, &status, 0) != 0) {
+        return -1;
+    }
+#endif
+    return status;
+}
+
+// One pool per node, its metadata in the region bound to the node and
+// exactly the pages asked for after it. Runs on single-node hosts too.
+static void check_numa(void) {
+    static struct buddy_numa numa;
+    CHECK(buddy_numa_init(&numa, 0) == -EINVAL);
+    CHECK(buddy_numa_init(&numa, PAGES) == OK);
+    CHECK(numa.nodes >= 1);
+    CHECK(buddy_numa_query_count(&numa, 14) == numa.nodes);
+
+    for (int i = 0; i < numa.nodes; i++) {
+        CHECK((void *)numa.pools[i] == numa.regions[i]);
+        CHECK(numa.pools[i]->total_pages == PAGES);
+        CHECK(numa.order[i][0] == i);
+        int node = node_of_page(numa.pools[i]);
+        CHECK(node < 0 || node == numa.node_ids[i]);
+    }
+
+    // A whole pool per node, then nothing
+    static void *blocks[BUDDY_NUMA_MAX_NODES];
+    for (int i = 0; i < numa.nodes; i++) {
+        blocks[i] = buddy_numa_alloc(&numa, 14);
+        CHECK(!IS_ERR(blocks[i]));
+        int node = buddy_numa_node_of(&numa, blocks[i]);
+        CHECK(node >= 0 && node < BUDDY_NUMA_MAX_NODES);
+    }
+    CHECK(buddy_numa_alloc(&numa, 14) == ERR_PTR(-ENOSPC));
+    CHECK(buddy_numa_query_count(&numa, 14) == 0);
+    CHECK(buddy_numa_node_of(&numa, memory) == -EINVAL);
+    CHECK(buddy_numa_free(&numa, memory) == -EINVAL);
+    for (int i = 0; i < numa.nodes; i++) {
+        CHECK(buddy_numa_free(&numa, blocks[i]) == OK);
+    }
+    CHECK(buddy_numa_query_count(&numa, 14) == numa.nodes);
+    for (int i = 0; i < numa.nodes; i++) {
+        CHECK(buddy_verify(numa.pools[i]) == OK);
+    }
+
+    buddy_numa_destroy(&numa);
+    CHECK(numa.nodes == 0);
+}
+
+// A pool formatted into a region is found again by attaching to it, but
+// only in page-aligned regions, whose blocks come out page-aligned too
+static void check_format(void) {
+    char *region = (char *)memory + (size_t)PAGES / 2 * BUDDY_PAGE_SIZE;
+    CHECK(buddy_format(region + 64, PAGES / 2) == ERR_PTR(-EINVAL));
+    CHECK(buddy_attach(region + 64, PAGES / 2) == ERR_PTR(-EINVAL));
+
+    struct buddy_pool *pool = buddy_format(region, PAGES / 2);
+    CHECK(!IS_ERR(pool));
+    if (IS_ERR(pool)) return;
+    void *p = buddy_alloc(pool, 3);
+    CHECK(!IS_ERR(p) && (uintptr_t)p % BUDDY_PAGE_SIZE == 0);
+
+    struct buddy_pool *again = buddy_attach(region, PAGES / 2);
+    CHECK(again == pool);
+    CHECK(buddy_query_rank(again, p) == 3);
+    CHECK(buddy_free(again, p) == OK);
+    CHECK(buddy_verify(again) == OK);
+}
+
+// Bulk calls are traced as the single calls they stand for, so a replay
+// sees every block allocated before it is freed
+static void check_trace_bulk(void) {
+    static unsigned char buf[4096];
+    void *pages[9];
+    struct buddy_trace_reader reader;
+    struct buddy_trace_event ev;
+    int allocs = 0, frees = 0, refused = 0, unseen = 0;
+    int seen[PAGES] = {0};
+
+    CHECK(trace_pages_start(buf, sizeof(buf), NULL, NULL) == OK);
+    CHECK(alloc_pages_bulk(2, 8, pages) == 8);
+    pages[8] = pages[3];
+    CHECK(return_pages_bulk(pages, 9) == 8);
+    CHECK(return_pages_bulk(pages, 1) == 0);
+    size_t bytes = trace_pages_stop();
+
+    CHECK(buddy_trace_open(&reader, buf, bytes) == OK);
+    while (buddy_trace_next(&reader, &ev) == 1) {
+        if (ev.op == BUDDY_TRACE_ALLOC && ev.page >= 0) {
+            allocs++;
+            seen[ev.page] = 1;
+        } else if (ev.op == BUDDY_TRACE_FREE && ev.result == OK) {
+            frees++;
+            if (!seen[ev.page]) unseen++;
+            seen[ev.page] = 0;
+        } else if (ev.op == BUDDY_TRACE_FREE) {
+            refused++;
+        }
+    }
+    CHECK(allocs == 8);
+    CHECK(frees == 8);
+    CHECK(refused == 2);
+    CHECK(unseen == 0);
+}
+
+// Constrained allocations keep their bounds in the trace, so replaying
+// one on a fresh pool asks for, and gets, the same blocks
+static void check_trace_constrained(void) {
+    static unsigned char buf[4096];
+    static void *slots[64];
+    struct buddy_trace_reader reader;
+    struct buddy_trace_event ev;
+    char *base = memory;
+    int events = 0, failures = 0, diverged = 0;
+
+    CHECK(trace_pages_start(buf, sizeof(buf), NULL, NULL) == OK);
+    unsigned int seed = 11;
+    for (int op = 0; op < 400; op++) {
+        int i = next_random(&seed) % 64;
+        if (slots[i] != NULL) {
+            CHECK(return_pages(slots[i]) == OK);
+            slots[i] = NULL;
+            continue;
+        }
+        unsigned int r = next_random(&seed);
+        char *limit = r % 2 ? base + (size_t)(r / 2 % 64) * BUDDY_PAGE_SIZE
+                            : NULL;
+        void *p = alloc_pages_constrained(r / 128 % 3 + 1, r / 512 % 5,
+                                          limit);
+        if (!IS_ERR(p)) slots[i] = p;
+    }
+    CHECK(alloc_pages_constrained(15, 0, NULL) == ERR_PTR(-ENOSPC));
+    size_t bytes = trace_pages_stop();
+    release_all(slots, 64);
+
+    init_page(memory, PAGES);
+    CHECK(buddy_trace_open(&reader, buf, bytes) == OK);
+    while (buddy_trace_next(&reader, &ev) == 1) {
+        if (ev.op == BUDDY_TRACE_ALLOC_CONSTRAINED) {
+            char *limit = ev.limit < PAGES
+                              ? base + (size_t)ev.limit * BUDDY_PAGE_SIZE
+                              : NULL;
+            void *p = alloc_pages_constrained(ev.rank, ev.align_rank, limit);
+            void *want = ev.page < 0 ? ERR_PTR(-ENOSPC)
+                                     : base + (size_t)ev.page *
+                                                  BUDDY_PAGE_SIZE;
+            if (p != want) diverged++;
+            events++;
+            if (ev.page < 0) failures++;
+        } else if (ev.op == BUDDY_TRACE_FREE) {
+            void *p = base + (size_t)ev.page * BUDDY_PAGE_SIZE;
+            if (return_pages(p) != ev.result) diverged++;
+        } else if (ev.op != BUDDY_TRACE_START || ev.page != PAGES) {
+            diverged++;
+        }
+    }
+    CHECK(events > 100);
+    CHECK(failures > 0);
+    CHECK(diverged == 0);
+    CHECK(reader.pos == reader.end);
+    CHECK(verify_pages() == OK);
+}
+
+// Helper function to check a block against the constraints it was asked
+// for
+static int fits(void *p, int rank, int align_rank, char *max_addr) {
+    uintptr_t a = (uintptr_t)p;
+    uintptr_t align = 1;
+    if (align_rank > 0) align = (uintptr_t)BUDDY_PAGE_SIZE << (align_rank - 1);
+    return !IS_ERR(p) && query_ranks(p) == rank && a % align == 0 &&
+           (max_addr == NULL ||
+            a + ((uintptr_t)BUDDY_PAGE_SIZE << (rank - 1)) <=
+                (uintptr_t)max_addr);
+}
+
+static void check_constrained(void) {
+    static void *pages[PAGES];
+    static void *slots[SLOTS];
+    char *base = memory;
+
+    // With every page taken but a few, the answers are known exactly
+    for (int i = 0; i < PAGES; i++) pages[i] = alloc_pages(1);
+    CHECK(return_pages(pages[5]) == OK);
+    CHECK(return_pages(pages[1001]) == OK);
+    for (int i = 16; i < 24; i++) CHECK(return_pages(pages[i]) == OK);
+    drain_pages();
+    CHECK(alloc_pages_constrained(1, 0, base + 5 * BUDDY_PAGE_SIZE) ==
+          ERR_PTR(-ENOSPC));
+    CHECK(alloc_pages_constrained(1, 0, base + 6 * BUDDY_PAGE_SIZE) ==
+          pages[5]);
+    CHECK(alloc_pages_constrained(1, 4, NULL) == pages[16]);
+    CHECK(alloc_pages_constrained(2, 2, NULL) == pages[18]);
+    CHECK(alloc_pages_constrained(1, 2, NULL) == pages[20]);
+    CHECK(alloc_pages_constrained(1, 4, NULL) == ERR_PTR(-ENOSPC));
+    CHECK(alloc_pages_constrained(1, 3, NULL) == ERR_PTR(-ENOSPC));
+    CHECK(alloc_pages_constrained(1, 0, NULL) != ERR_PTR(-ENOSPC));
+    CHECK(alloc_pages_constrained(0, 0, NULL) == ERR_PTR(-EINVAL));
+    CHECK(alloc_pages_constrained(1, -1, NULL) == ERR_PTR(-EINVAL));
+    CHECK(verify_pages() == OK);
+
+    // Mixed with ordinary traffic, every block granted fits its request
+    init_page(memory, PAGES);
+    unsigned int seed = 7;
+    for (int op = 0; op < 20000; op++) {
+        int i = next_random(&seed) % SLOTS;
+        if (slots[i] != NULL) {
+            CHECK(return_pages(slots[i]) == OK);
+            slots[i] = NULL;
+            continue;
+        }
+        unsigned int r = next_random(&seed);
+        int rank = r % 4 + 1, align_rank = r / 4 % 8;
+        char *limit = r / 32 % 2
+                          ? base + (size_t)(r / 64 % PAGES) * BUDDY_PAGE_SIZE
+                          : NULL;
+        void *p = alloc_pages_constrained(rank, align_rank, limit);
+        if (IS_ERR(p)) {
+            CHECK(p == ERR_PTR(-ENOSPC));
+        } else {
+            CHECK(fits(p, rank, align_rank, limit));
+            slots[i] = p;
+        }
+    }
+    CHECK(verify_pages() == OK);
+    release_all(slots, SLOTS);
+}
+
+// A pool over its own mapping hands out every page of it, and the
+// hugetlb flag falls back to normal pages where none are reserved
+static void check_mapped(void) {
+    static const unsigned int flags[] = {
+        0, BUDDY_MAP_PREFAULT, BUDDY_MAP_HUGETLB,
+        BUDDY_MAP_HUGETLB | BUDDY_MAP_PREFAULT,
+    };
+    static void *pages[PAGES];
+    static unsigned char resident[PAGES];
+    static struct buddy_pool pool;
+    size_t bytes = (size_t)PAGES * BUDDY_PAGE_SIZE;
+
+    CHECK(buddy_init_mapped(&pool, 0, 0) == ERR_PTR(-EINVAL));
+    CHECK(buddy_init_mapped(&pool, PAGES, 0x80) == ERR_PTR(-EINVAL));
+    for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+        char *base = buddy_init_mapped(&pool, PAGES, flags[f]);
+        CHECK(!IS_ERR(base));
+        if (IS_ERR(base)) continue;
+        CHECK((uintptr_t)base % (2 << 20) == 0);
+        if (flags[f] & BUDDY_MAP_PREFAULT) {
+            int kept = 0;
+            CHECK(mincore(base, bytes, resident) == 0);
+            for (size_t i = 0; i < bytes / sysconf(_SC_PAGESIZE); i++) {
+                kept += resident[i] & 1;
+            }
+            CHECK(kept == (int)(bytes / sysconf(_SC_PAGESIZE)));
+        }
+
+        int outside = 0;
+        for (int i = 0; i < PAGES; i++) {
+            char *p = pages[i] = buddy_alloc(&pool, 1);
+            CHECK(!IS_ERR(p));
+            if (IS_ERR(p)) break;
+            if (p < base || p >= base + bytes) outside++;
+            else memset(p, i, BUDDY_PAGE_SIZE);
+        }
+        CHECK(outside == 0);
+        CHECK(buddy_alloc(&pool, 1) == ERR_PTR(-ENOSPC));
+        for (int i = 0; i < PAGES; i++) {
+            if (!IS_ERR(pages[i])) CHECK(buddy_free(&pool, pages[i]) == OK);
+        }
+        void *whole = buddy_alloc(&pool, 14);
+        CHECK(whole == base);
+        CHECK(buddy_free(&pool, whole) == OK);
+        CHECK(buddy_verify(&pool) == OK);
+        buddy_destroy(&pool);
+    }
+}
+
+// Pages freed one at a time, wherever they are parked, still make up the
+// whole pool for the next large request
+static void check_drain_on_miss(void) {
+    static void *pages[PAGES];
+    for (int i = 0; i < PAGES; i++) {
+        pages[i] = alloc_pages(1);
+        CHECK(!IS_ERR(pages[i]));
+    }
+    CHECK(alloc_pages(1) == ERR_PTR(-ENOSPC));
+    for (int i = 0; i < PAGES; i++) CHECK(return_pages(pages[i]) == OK);
+
+    void *whole = alloc_pages(14);
+    CHECK(!IS_ERR(whole));
+    CHECK(return_pages(whole) == OK);
+    int got = alloc_pages_bulk(2, PAGES / 2, pages);
+    CHECK(got == PAGES / 2);
+    for (int i = 0; i < got; i++) CHECK(return_pages(pages[i]) == OK);
+    CHECK(alloc_pages_constrained(14, 0, NULL) != ERR_PTR(-ENOSPC));
+}
+
+#if BUDDY_LOCKING != BUDDY_LOCK_NONE
+static int watch_stop;
+
+static void *watch_worker(void *arg) {
+    static void *slots[2][SLOTS];
+    int id = (int)(size_t)arg;
+    unsigned int seed = id * 2654435761u + 1;
+    while (!__atomic_load_n(&watch_stop, __ATOMIC_RELAXED)) {
+        churn(slots[id], SLOTS, seed++, 1000);
+    }
+    release_all(slots[id], SLOTS);
+    return NULL;
+}
+
+// Check now and then, as a watchdog would, and count the failures
+static void *watchdog(void *arg) {
+    long errors = 0;
+    (void)arg;
+    for (int i = 0; i < WATCH_CHECKS; i++) {
+        if (verify_pages() != OK) errors++;
+        usleep(50);
+    }
+    __atomic_store_n(&watch_stop, 1, __ATOMIC_RELAXED);
+    return (void *)errors;
+}
+
+// A watchdog checking the pool while two threads churn it must never see
+// it inconsistent
+static void check_verify_concurrent(void) {
+    pthread_t workers[2], dog;
+    void *errors;
+
+    watch_stop = 0;
+    for (int t = 0; t < 2; t++) {
+        pthread_create(&workers[t], NULL, watch_worker, (void *)(size_t)t);
+    }
+    pthread_create(&dog, NULL, watchdog, NULL);
+    pthread_join(dog, &errors);
+    for (int t = 0; t < 2; t++) pthread_join(workers[t], NULL);
+
+    CHECK(errors == NULL);
+    drain_pages();
+    CHECK(verify_pages() == OK);
+    CHECK(query_free_pages() == PAGES);
+}
+
+static void *constrained_worker(void *arg) {
+    static void *slots[2][64];
+    int id = (int)(size_t)arg;
+    char *limit = (char *)memory + (size_t)PAGES / 4 * BUDDY_PAGE_SIZE;
+    unsigned int seed = id + 11;
+    while (!__atomic_load_n(&watch_stop, __ATOMIC_RELAXED)) {
+        int i = next_random(&seed) % 64;
+        if (slots[id][i] != NULL) {
+            CHECK(return_pages(slots[id][i]) == OK);
+            slots[id][i] = NULL;
+        } else {
+            void *p = alloc_pages_constrained(2, 3, limit);
+            if (!IS_ERR(p)) {
+                CHECK(fits(p, 2, 3, limit));
+                slots[id][i] = p;
+            }
+        }
+    }
+    release_all(slots[id], 64);
+    return NULL;
+}
+
+// Constrained requests race ordinary ones for the same low pages
+static void check_constrained_concurrent(void) {
+    pthread_t workers[4];
+
+    watch_stop = 0;
+    for (int t = 0; t < 2; t++) {
+        pthread_create(&workers[t], NULL, watch_worker, (void *)(size_t)t);
+        pthread_create(&workers[t + 2], NULL, constrained_worker,
+                       (void *)(size_t)t);
+    }
+    usleep(200000);
+    __atomic_store_n(&watch_stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < 4; t++) pthread_join(workers[t], NULL);
+
+    drain_pages();
+    CHECK(verify_pages() == OK);
+    CHECK(query_free_pages() == PAGES);
+}
+
+static long churn_low_calls;
+
+static void on_churn_low(struct buddy_pool *pool, long free_pages,
+                         void *arg) {
+    (void)pool;
+    (void)free_pages;
+    CHECK(arg == &churn_low_calls);
+    __atomic_fetch_add(&churn_low_calls, 1, __ATOMIC_RELAXED);
+}
+
+// The low-memory callback can be set and cleared while other threads
+// allocate and free, and is only ever called with its own argument
+static void check_watermarks_concurrent(void) {
+    pthread_t workers[2];
+
+    watch_stop = 0;
+    churn_low_calls = 0;
+    for (int t = 0; t < 2; t++) {
+        pthread_create(&workers[t], NULL, watch_worker, (void *)(size_t)t);
+    }
+    for (int i = 0; i < 1000; i++) {
+        // Below low at once, and never back above high, so it fires once
+        CHECK(set_pages_watermarks(0, PAGES, PAGES, on_churn_low,
+                                   &churn_low_calls) == OK);
+        usleep(20);
+        CHECK(set_pages_watermarks(0, 0, 0, NULL, NULL) == OK);
+    }
+    __atomic_store_n(&watch_stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < 2; t++) pthread_join(workers[t], NULL);
+
+    CHECK(churn_low_calls > 0);
+    drain_pages();
+    CHECK(verify_pages() == OK);
+}
+
+#define DOUBLE_FREES (2048)
+static void *double_blocks[DOUBLE_FREES];
+static int double_freed;
+
+// Free every block, one thread singly and the other through the bulk call
+static void *double_worker(void *arg) {
+    int bulk = (int)(size_t)arg, freed = 0;
+    for (int i = 0; i < DOUBLE_FREES; i++) {
+        if (bulk) {
+            freed += return_pages_bulk(&double_blocks[i], 1);
+        } else {
+            freed += return_pages(double_blocks[i]) == OK;
+        }
+    }
+    __atomic_fetch_add(&double_freed, freed, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Two threads freeing the same blocks at once free each exactly once
+static void check_double_free_concurrent(void) {
+    pthread_t workers[2];
+
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < DOUBLE_FREES; i++) {
+            double_blocks[i] = alloc_pages(i % 3 + 1);
+        }
+        double_freed = 0;
+        for (int t = 0; t < 2; t++) {
+            pthread_create(&workers[t], NULL, double_worker, (void *)(size_t)t);
+        }
+        for (int t = 0; t < 2; t++) pthread_join(workers[t], NULL);
+        CHECK(double_freed == DOUBLE_FREES);
+        CHECK(verify_pages() == OK);
+    }
+    drain_pages();
+    CHECK(query_free_pages() == PAGES);
+}
+
+static void count_trace(const void *buf, size_t bytes, void *arg) {
+    (void)buf;
+    *(size_t *)arg += bytes;
+}
+
+// Tracing can be switched on and off while other threads use the pool
+static void check_trace_concurrent(void) {
+    static unsigned char buf[4096];
+    pthread_t workers[2];
+    size_t flushed = 0;
+
+    watch_stop = 0;
+    for (int t = 0; t < 2; t++) {
+        pthread_create(&workers[t], NULL, watch_worker, (void *)(size_t)t);
+    }
+    for (int i = 0; i < 500; i++) {
+        CHECK(trace_pages_start(buf, sizeof(buf), count_trace, &flushed) ==
+              OK);
+        usleep(50);
+        CHECK(trace_pages_stop() == 0);
+    }
+    __atomic_store_n(&watch_stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < 2; t++) pthread_join(workers[t], NULL);
+
+    CHECK(flushed > 0);
+    CHECK(verify_pages() == OK);
+}
+#endif
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} cases[] = {
+    {"compact", check_compact},
+    {"modes", check_modes},
+    {"debug", check_debug},
+    {"bulk", check_bulk},
+    {"watermarks", check_watermarks},
+    {"release", check_release},
+#if BUDDY_TAGS
+    {"tags", check_tags},
+#endif
+    {"slab", check_slab},
+    {"numa", check_numa},
+    {"drain_on_miss", check_drain_on_miss},
+    {"format", check_format},
+    {"mapped", check_mapped},
+    {"trace_bulk", check_trace_bulk},
+    {"trace_constrained", check_trace_constrained},
+    {"constrained", check_constrained},
+    {"verify", check_verify},
+#if BUDDY_LOCKING != BUDDY_LOCK_NONE
+    {"verify_concurrent", check_verify_concurrent},
+    {"trace_concurrent", check_trace_concurrent},
+    {"constrained_concurrent", check_constrained_concurrent},
+    {"double_free_concurrent", check_double_free_concurrent},
+    {"watermarks_concurrent", check_watermarks_concurrent},
+#endif
+};
+
+int main(void) {
+    int total = 0;
+    memory = aligned_alloc(1 << 21, (size_t)PAGES * BUDDY_PAGE_SIZE);
+    if (memory == NULL) return 1;
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        int before = failed;
+        init_page(memory, PAGES);
+        cases[c].run();
+        printf("%-24s %s\n", cases[c].name, failed == before ? "ok" : "FAILED");
+        total++;
+    }
+    printf("%d cases, %d failed checks\n", total, failed);
+
+    free(memory);
+    return failed != 0;
+}
@@ -0,0 +1,131 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+#include "buddy_numa.h"
+
+// Multithreaded stress benchmark. Each thread churns a private working set
+// of rank-1/rank-2 blocks on the shared default pool. Built once per
+// BUDDY_LOCKING mode; BUDDY_LOCK_NONE wraps every call in one mutex, which
+// is the arrangement the locking modes replace. -DBENCH_NUMA runs the same
+// churn through the per-node pools of buddy_numa.c instead.
+
+#define TESTSIZE (128)
+#define MAXRANK0PAGE (TESTSIZE * 1024 / 4)
+#define MAXTHREADS (16)
+#define SLOTS (256)
+#define OPS (1000000)
+
+#ifndef BENCH_NUMA
+#define BENCH_NUMA 0
+#endif
+
+#if BENCH_NUMA
+#define bench_init(p, pgcount) numa_init_pages(pgcount)
+#define bench_alloc numa_alloc_pages
+#define bench_free numa_return_pages
+#define bench_count numa_query_page_counts
+#elif BUDDY_LOCKING == BUDDY_LOCK_NONE
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *bench_alloc(int rank) {
+    pthread_mutex_lock(&big_lock);
+    void *r = alloc_pages(rank);
+    pthread_mutex_unlock(&big_lock);
+    return r;
+}
+
+static int bench_free(void *p) {
+    pthread_mutex_lock(&big_lock);
+    int ret = return_pages(p);
+    pthread_mutex_unlock(&big_lock);
+    return ret;
+}
+#else
+#define bench_alloc alloc_pages
+#define bench_free return_pages
+#endif
+
+#if !BENCH_NUMA
+#define bench_init init_page
+#define bench_count query_page_counts
+#endif
+
+static const char *mode_name(void) {
+    if (BENCH_NUMA) return "per-node pools, per-rank spinlocks";
+    switch (BUDDY_LOCKING) {
+    case BUDDY_LOCK_GLOBAL: return "global spinlock";
+    case BUDDY_LOCK_RANK:
+        if (BUDDY_LOCKFREE) return "per-rank spinlocks + lock-free rank 1";
+        return BUDDY_PCP ? "per-rank spinlocks + pcp" : "per-rank spinlocks";
+    default: return "external mutex";
+    }
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *worker(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg * 2654435761u + 1;
+    void *slots[SLOTS] = {0};
+    long failures = 0;
+    int op, i;
+
+    for (op = 0; op < OPS; op++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        i = seed % SLOTS;
+        if (slots[i] != NULL) {
+            bench_free(slots[i]);
+            slots[i] = NULL;
+        } else {
+            void *r = bench_alloc((seed >> 16) % 4 == 0 ? 2 : 1);
+            if (IS_ERR(r)) failures++;
+            else slots[i] = r;
+        }
+    }
+    for (i = 0; i < SLOTS; i++)
+        if (slots[i] != NULL) bench_free(slots[i]);
+    return (void *)failures;
+}
+
+int main(int argc, char **argv) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 8;
+    pthread_t threads[MAXTHREADS];
+    void *p = malloc(TESTSIZE * sizeof(char) * 1024 * 1024);
+    int nthreads, t;
+
+    if (maxThreads < 1 || maxThreads > MAXTHREADS) maxThreads = MAXTHREADS;
+    printf("mode: %s\n", mode_name());
+    printf("%-8s %16s %10s\n", "threads", "ops/sec", "failures");
+    for (nthreads = 1; nthreads <= maxThreads; nthreads *= 2) {
+        long failures = 0;
+        bench_init(p, MAXRANK0PAGE);
+        int whole = bench_count(16);
+
+        double start = now_sec();
+        for (t = 0; t < nthreads; t++)
+            pthread_create(&threads[t], NULL, worker, (void *)(size_t)t);
+        for (t = 0; t < nthreads; t++) {
+            void *ret;
+            pthread_join(threads[t], &ret);
+            failures += (long)ret;
+        }
+        double elapsed = now_sec() - start;
+
+        printf("%-8d %16.0f %10ld", nthreads,
+               (double)nthreads * OPS / elapsed, failures);
+        // Everything was returned, so the pools must have merged back whole
+        drain_pages();
+        printf("%s\n", bench_count(16) == whole ? "" : "  (pool not whole!)");
+    }
+
+    free(p);
+    return 0;
+}